@@ -1 +1,2 @@
-g++ -g -ggdb -O0 --std=c++11 zev.cpp -lSDL2 -lGL -lGLU -Wall -Wextra -Wno-unused
+g++ -g -ggdb -O0 --std=c++11 zev.cpp -lSDL2 -lGL -lGLU -pthread -lrt -Wall -Wextra -Wno-unused
+g++ -g -ggdb -O0 --std=c++11 zmapgen.cpp -o zmapgen -Wall -Wextra -Wno-unused
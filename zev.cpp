@@ -18,10 +18,33 @@ THIS SOFTWARE.
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <string.h>
 #include <math.h>
 
 #include <vector>
 #include <stack>
+#include <map>
+#include <set>
+#include <tuple>
+#include <algorithm>
+#include <string>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#endif
 
 #include "endian.h"
 
@@ -37,231 +60,2158 @@ float sens = 1.0/32;
 
 
 char * currentzmap;
+uint32_t currentsize;
+bool badzmap; // set when parsing runs off the end of currentzmap or loops
 
 uint8_t mem8(uint32_t addr)
 {
+    if(addr >= currentsize)
+    {   badzmap = true; return 0; }
     return *(currentzmap+addr);
 }
-uint32_t mem32(uint32_t addr)
+uint32_t mem32(uint32_t addr)
+{
+    if(addr >= currentsize or currentsize-addr < 4)
+    {   badzmap = true; return 0; }
+    uint32_t word; // dlist pointers in corrupt files needn't be aligned
+    memcpy(&word, currentzmap+addr, 4);
+    return swap32(word);
+}
+
+// deeper than any real dlist nests; past it a dlist is assumed to call itself
+#define MAXDLISTDEPTH 64
+// and far more commands than a 16MB segment holds, for calls that fan out
+#define MAXDLISTSTEPS (1<<26)
+
+struct vertex
+{
+    int16_t x = 0;
+    int16_t y = 0;
+    int16_t z = 0;
+    uint16_t nothing = 0;
+    
+    int16_t u = 0;
+    int16_t v = 0;
+    
+    int8_t i = 0;
+    int8_t j = 0;
+    int8_t k = 0;
+    int8_t l = 0;
+    vertex() { }
+    vertex(uint32_t addr, bool print)
+    {
+        uint32_t rawdata = mem32(addr);
+        x = (rawdata & 0xFFFF0000)
+                     / 0x00010000;
+        y = (rawdata & 0x0000FFFF)
+                     / 0x00000001;
+        rawdata = mem32(addr+4);
+        z = (rawdata & 0xFFFF0000)
+                     / 0x00010000;
+        rawdata = mem32(addr+8);
+        u = (rawdata & 0xFFFF0000)
+                     / 0x00010000;
+        v = (rawdata & 0x0000FFFF)
+                     / 0x00000001;
+        rawdata = mem32(addr+12);
+        i = (rawdata & 0xFF000000)
+                     / 0x01000000;
+        j = (rawdata & 0x00FF0000)
+                     / 0x00010000;
+        k = (rawdata & 0x0000FF00)
+                     / 0x00000100;
+        l = (rawdata & 0x000000FF)
+                     / 0x00000001;
+        if(print)
+            {}//printf("made vertex %d %d %d : %d %d %d\n", x, y, z, i, j, k);
+    }
+};
+
+// vertices go to the GPU exactly as they sit in the zmap (minus byteswapping)
+static_assert(sizeof(vertex) == 16, "vertex must match the N64 vertex layout");
+
+struct dlistpointer
+{
+    char * buffer;
+    uint32_t offset;
+};
+
+// GL 2.0 entry points, fetched through SDL once there's a context
+#define GLFUNCS \
+    GLFUNC(PFNGLCREATESHADERPROC, glCreateShader) \
+    GLFUNC(PFNGLSHADERSOURCEPROC, glShaderSource) \
+    GLFUNC(PFNGLCOMPILESHADERPROC, glCompileShader) \
+    GLFUNC(PFNGLGETSHADERIVPROC, glGetShaderiv) \
+    GLFUNC(PFNGLGETSHADERINFOLOGPROC, glGetShaderInfoLog) \
+    GLFUNC(PFNGLCREATEPROGRAMPROC, glCreateProgram) \
+    GLFUNC(PFNGLATTACHSHADERPROC, glAttachShader) \
+    GLFUNC(PFNGLBINDATTRIBLOCATIONPROC, glBindAttribLocation) \
+    GLFUNC(PFNGLLINKPROGRAMPROC, glLinkProgram) \
+    GLFUNC(PFNGLGETPROGRAMIVPROC, glGetProgramiv) \
+    GLFUNC(PFNGLGETPROGRAMINFOLOGPROC, glGetProgramInfoLog) \
+    GLFUNC(PFNGLUSEPROGRAMPROC, glUseProgram) \
+    GLFUNC(PFNGLGETUNIFORMLOCATIONPROC, glGetUniformLocation) \
+    GLFUNC(PFNGLUNIFORM1IPROC, glUniform1i) \
+    GLFUNC(PFNGLGENBUFFERSPROC, glGenBuffers) \
+    GLFUNC(PFNGLBINDBUFFERPROC, glBindBuffer) \
+    GLFUNC(PFNGLBUFFERDATAPROC, glBufferData) \
+    GLFUNC(PFNGLDELETEBUFFERSPROC, glDeleteBuffers) \
+    GLFUNC(PFNGLVERTEXATTRIBPOINTERPROC, glVertexAttribPointer) \
+    GLFUNC(PFNGLENABLEVERTEXATTRIBARRAYPROC, glEnableVertexAttribArray) \
+    GLFUNC(PFNGLDISABLEVERTEXATTRIBARRAYPROC, glDisableVertexAttribArray)
+
+// framebuffer objects are GL 3.0; only server mode renders offscreen
+#define SERVERGLFUNCS \
+    GLFUNC(PFNGLGENFRAMEBUFFERSPROC, glGenFramebuffers) \
+    GLFUNC(PFNGLBINDFRAMEBUFFERPROC, glBindFramebuffer) \
+    GLFUNC(PFNGLFRAMEBUFFERRENDERBUFFERPROC, glFramebufferRenderbuffer) \
+    GLFUNC(PFNGLCHECKFRAMEBUFFERSTATUSPROC, glCheckFramebufferStatus) \
+    GLFUNC(PFNGLGENRENDERBUFFERSPROC, glGenRenderbuffers) \
+    GLFUNC(PFNGLBINDRENDERBUFFERPROC, glBindRenderbuffer) \
+    GLFUNC(PFNGLRENDERBUFFERSTORAGEPROC, glRenderbufferStorage)
+
+// the pointers get a prefix so they can't clash with libGL's own exports
+#define GLFUNC(type, name) type p_##name;
+GLFUNCS
+SERVERGLFUNCS
+#undef GLFUNC
+
+#define glCreateShader p_glCreateShader
+#define glShaderSource p_glShaderSource
+#define glCompileShader p_glCompileShader
+#define glGetShaderiv p_glGetShaderiv
+#define glGetShaderInfoLog p_glGetShaderInfoLog
+#define glCreateProgram p_glCreateProgram
+#define glAttachShader p_glAttachShader
+#define glBindAttribLocation p_glBindAttribLocation
+#define glLinkProgram p_glLinkProgram
+#define glGetProgramiv p_glGetProgramiv
+#define glGetProgramInfoLog p_glGetProgramInfoLog
+#define glUseProgram p_glUseProgram
+#define glGetUniformLocation p_glGetUniformLocation
+#define glUniform1i p_glUniform1i
+#define glGenBuffers p_glGenBuffers
+#define glBindBuffer p_glBindBuffer
+#define glBufferData p_glBufferData
+#define glDeleteBuffers p_glDeleteBuffers
+#define glVertexAttribPointer p_glVertexAttribPointer
+#define glEnableVertexAttribArray p_glEnableVertexAttribArray
+#define glDisableVertexAttribArray p_glDisableVertexAttribArray
+#define glGenFramebuffers p_glGenFramebuffers
+#define glBindFramebuffer p_glBindFramebuffer
+#define glFramebufferRenderbuffer p_glFramebufferRenderbuffer
+#define glCheckFramebufferStatus p_glCheckFramebufferStatus
+#define glGenRenderbuffers p_glGenRenderbuffers
+#define glBindRenderbuffer p_glBindRenderbuffer
+#define glRenderbufferStorage p_glRenderbufferStorage
+
+#define GLFUNC(type, name) \
+    p_##name = (type)SDL_GL_GetProcAddress(#name); \
+    if(!p_##name) \
+    {   printf("Missing GL function %s\n", #name); return false; }
+bool loadglfuncs()
+{
+    GLFUNCS
+    return true;
+}
+bool loadserverglfuncs()
+{
+    SERVERGLFUNCS
+    return true;
+}
+#undef GLFUNC
+
+// attribute slots are bound before linking so the mesh code can hardcode them
+enum
+{
+    attrib_position,
+    attrib_uv,
+    attrib_normal,
+    attrib_color
+};
+
+// packed vertices are decoded here; lighting mirrors what the old
+// fixed-function setup produced (global ambient * default material ambient
+// plus one directional light * default material diffuse)
+const char * vertexshader = R"(
+#version 120
+attribute vec3 position;
+attribute vec2 uv;
+attribute vec3 normal;
+attribute vec4 color;
+uniform bool lit;
+varying vec4 shade;
+void main()
+{
+    gl_Position = gl_ModelViewProjectionMatrix * vec4(position, 1.0);
+    if(lit)
+    {
+        float diffuse = 0.0;
+        if(dot(normal, normal) > 0.0)
+            diffuse = max(dot(normalize(normal), normalize(vec3(1.0, 1.0, 0.2))), 0.0);
+        shade = vec4(vec3(0.28, 0.30, 0.32) + vec3(0.8, 0.72, 0.64)*diffuse, 1.0);
+    }
+    else
+        shade = vec4(color.rgb, 1.0);
+}
+)";
+
+const char * fragmentshader = R"(
+#version 120
+varying vec4 shade;
+void main()
+{
+    gl_FragColor = shade;
+}
+)";
+
+GLuint buildshader(GLenum type, const char * source)
+{
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+    
+    GLint status;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if(!status)
+    {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        printf("Shader compilation failed: %s\n", log);
+        return 0;
+    }
+    return shader;
+}
+
+GLuint buildprogram()
+{
+    GLuint vshader = buildshader(GL_VERTEX_SHADER, vertexshader);
+    GLuint fshader = buildshader(GL_FRAGMENT_SHADER, fragmentshader);
+    if(!vshader or !fshader)
+        return 0;
+    
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vshader);
+    glAttachShader(program, fshader);
+    glBindAttribLocation(program, attrib_position, "position");
+    glBindAttribLocation(program, attrib_uv, "uv");
+    glBindAttribLocation(program, attrib_normal, "normal");
+    glBindAttribLocation(program, attrib_color, "color");
+    glLinkProgram(program);
+    
+    GLint status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if(!status)
+    {
+        char log[1024];
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        printf("Shader linking failed: %s\n", log);
+        return 0;
+    }
+    return program;
+}
+
+// a run of triangles sharing the same 0xD9 state
+struct batch
+{
+    uint32_t first; // offset into mesh::indices
+    uint32_t count;
+    bool lit;
+    uint8_t cull; // 1: front faces, 2: back faces
+};
+
+struct triangle
+{
+    uint32_t a, b, c;
+    bool lit;
+    uint8_t cull;
+    bool operator==(const triangle & other) const
+    {
+        return a == other.a and b == other.b and c == other.c
+           and lit == other.lit and cull == other.cull;
+    }
+    bool operator<(const triangle & other) const
+    {
+        return std::tie(a, b, c, lit, cull) < std::tie(other.a, other.b, other.c, other.lit, other.cull);
+    }
+};
+
+// what one 0xDE call to a sub-dlist produced. zev doesn't apply 0xDA
+// matrices, so every call that produces the same triangles puts them in the
+// same place and only the first one needs to be drawn
+struct subdlist
+{
+    uint32_t target;
+    uint32_t refs;
+    uint32_t collapsed; // calls outside any other capture that weren't drawn again
+    std::vector<triangle> tris;
+};
+
+// bounding volume hierarchy node, stored depth first: an inner node's left
+// child comes right after it and start holds its right child
+struct bvhnode
+{
+    float low[3];
+    float high[3];
+    uint32_t start;
+    uint32_t count; // triangles in a leaf, 0 for inner nodes
+};
+
+// every opaque dlist of a map, interpreted once and kept on the GPU
+struct mesh
+{
+    std::vector<vertex> verts;
+    std::vector<uint32_t> indices;
+    std::vector<batch> batches;
+    std::map<uint32_t, uint32_t> lookup; // vertex address -> verts index
+    std::map<uint32_t, uint32_t> calls; // sub-dlist address -> 0xDE references
+    std::vector<subdlist> shared;
+    std::map<uint32_t, std::vector<uint32_t>> variants; // sub-dlist address -> indices into shared
+    unsigned dlists = 0;
+    std::vector<bvhnode> bvh; // for server raycasts, see buildbvh
+    std::vector<uint32_t> bvhtris; // triangle numbers, grouped by leaf
+    GLuint vbo = 0;
+    GLuint ibo = 0;
+    GLuint normalvbo = 0; // viewer only: debug lines, xyz pairs
+    GLsizei normalcount = 0;
+};
+
+void addtri(mesh & m, uint32_t a, uint32_t b, uint32_t c, bool lit, uint8_t cull)
+{
+    if(m.batches.size() == 0 or m.batches.back().lit != lit or m.batches.back().cull != cull)
+        m.batches.push_back({(uint32_t)m.indices.size(), 0, lit, cull});
+    
+    m.indices.push_back(a);
+    m.indices.push_back(b);
+    m.indices.push_back(c);
+    m.batches.back().count += 3;
+}
+
+// walks a dlist the same way compiledlist does, only counting sub-dlist calls
+void countcalls(mesh & m, uint32_t index)
+{
+    std::stack<uint32_t> stack;
+    for(unsigned steps = 0; !badzmap; steps++)
+    {
+        if(steps >= MAXDLISTSTEPS)
+        {   badzmap = true; return; }
+        switch(mem8(index))
+        {
+        case 0xDE:
+            if(mem8(index+4) != 0x03)
+                break;
+            if(stack.size() >= MAXDLISTDEPTH)
+            {   badzmap = true; return; }
+            m.calls[mem32(index+4)&0x00FFFFFF]++;
+            stack.push(index+8);
+            index=mem32(index+4)&0x00FFFFFF;
+            continue;
+        case 0xDF:
+            if(stack.size() == 0)
+                return;
+            index = stack.top();
+            stack.pop();
+            continue;
+        }
+        index += 8;
+    }
+}
+
+struct sharestats
+{
+    unsigned shared = 0; // sub-dlist variants that saved at least one draw
+    unsigned collapsed = 0;
+    unsigned sharedtris = 0;
+    unsigned skippedtris = 0;
+};
+
+// only variants that actually saved a draw count; ones that were only ever
+// repeated inside another repeated variant are covered by that one. a
+// triangle can be in several variants, so it's only counted once
+sharestats getsharestats(const mesh & m)
+{
+    sharestats stats;
+    std::set<triangle> sharedtris;
+    for(auto & sub : m.shared)
+    {
+        if(sub.collapsed == 0)
+            continue;
+        stats.shared++;
+        stats.collapsed += sub.collapsed;
+        sharedtris.insert(sub.tris.begin(), sub.tris.end());
+        stats.skippedtris += sub.collapsed*sub.tris.size();
+    }
+    stats.sharedtris = sharedtris.size();
+    return stats;
+}
+
+// totals for maps loaded together; meshes don't share vertices, so their
+// shared triangles simply add up
+sharestats getsharestats(const std::vector<mesh> & meshes)
+{
+    sharestats stats;
+    for(auto & m : meshes)
+    {
+        sharestats more = getsharestats(m);
+        stats.shared += more.shared;
+        stats.collapsed += more.collapsed;
+        stats.sharedtris += more.sharedtris;
+        stats.skippedtris += more.skippedtris;
+    }
+    return stats;
+}
+
+// a sub-dlist call whose triangles are being held back until it returns
+struct capture
+{
+    uint32_t target;
+    size_t depth; // call stack size at the 0xDE
+    std::vector<triangle> tris;
+};
+
+void compiledlist(mesh & m, uint32_t index)
+{
+    //state
+    std::vector<uint32_t> slots; // vertex buffer entry -> verts index
+    std::stack<uint32_t> stack;
+    std::vector<capture> captures;
+    
+    bool normal = true;
+    bool filter = true;
+    bool normalize = true;
+    bool cullfront = false;
+    bool cullback = false;
+    bool unsupported = false;
+    unsigned steps = 0;
+    // interpret dlist
+    while(1)
+    {
+        skippc:
+        if(badzmap or ++steps > MAXDLISTSTEPS)
+        {   badzmap = true; return; }
+        switch(mem8(index))
+        {
+        case 0x01:
+            //puts("verts");
+            {
+                unsigned int count = (mem32(index)&0xFFF000)/0x1000;
+                int where = (mem32(index)&0x000FFF)/2;
+                where -= count;
+                
+                int addr = (mem32(index+4)&0x00FFFFFF);
+                if(mem8(index+4) != 03)
+                {
+                    unsupported = true;
+                    break;
+                }
+                unsupported = false;
+                for(unsigned i = 0; i < count; i++)
+                {
+                    uint32_t vaddr = addr + i*16;
+                    auto found = m.lookup.find(vaddr);
+                    if(found == m.lookup.end())
+                    {
+                        found = m.lookup.insert({vaddr, (uint32_t)m.verts.size()}).first;
+                        m.verts.push_back(vertex(vaddr, true));
+                    }
+                    if(where+i >= slots.size())
+                        slots.push_back(found->second);
+                    else
+                        slots[where+i] = found->second;
+                }
+            }
+            break;
+        
+        #define autotri(v1, v2, v3) \
+            if(mem8(index+(v1))/2 < slots.size() \
+            and mem8(index+(v2))/2 < slots.size() \
+            and mem8(index+(v3))/2 < slots.size()) \
+            { \
+                triangle tri = { slots[mem8(index+(v1))/2] \
+                               , slots[mem8(index+(v2))/2] \
+                               , slots[mem8(index+(v3))/2] \
+                               , normalize, uint8_t(cullfront | cullback<<1) }; \
+                if(captures.size() > 0) \
+                    captures.back().tris.push_back(tri); \
+                else \
+                    addtri(m, tri.a, tri.b, tri.c, tri.lit, tri.cull); \
+            }
+        
+        case 0x05:
+            //puts("tri1");
+            if(unsupported)
+                break;
+            autotri(1, 2, 3);
+            break;
+        case 0x06:
+            //puts("tri2");
+            if(unsupported)
+                break;
+            autotri(1, 2, 3);
+            autotri(4+1, 4+2, 4+3);
+            break;
+        
+        #undef autotri
+        
+        case 0x07:
+            //puts("quad");
+            // TODO
+            break;
+        case 0xD9:
+            //puts("mode");
+            {
+                bool filterclear = ((0x00200000&mem32(index  )) != 0);
+                bool normalclear = ((0x00020000&mem32(index  )) != 0);
+                bool backclear   = ((0x00000400&mem32(index  )) != 0);
+                bool frontclear  = ((0x00000200&mem32(index  )) != 0);
+                bool filterenset = ((0x00200000&mem32(index+4)) != 0);
+                bool normalenset = ((0x00020000&mem32(index+4)) != 0);
+                bool backset     = ((0x00000400&mem32(index+4)) != 0);
+                bool frontset    = ((0x00000200&mem32(index+4)) != 0);
+                
+                filter = filterenset|(filter&filterclear);
+                normal = normalenset|(normal&normalclear);
+                cullback = backset|(cullback&backclear);
+                cullfront = frontset|(cullfront&frontclear);
+                
+                if(normal)
+                    normalize = true;
+                else if(filter)
+                    normalize = false;
+            }
+            // TODO
+            break;
+        case 0xDE:
+            //puts("subdl");
+            if(mem8(index+4) != 0x03)
+                break;
+            if(stack.size() >= MAXDLISTDEPTH)
+            {   badzmap = true; return; }
+            if(m.calls[mem32(index+4)&0x00FFFFFF] > 1)
+                captures.push_back({mem32(index+4)&0x00FFFFFF, stack.size(), {}});
+            stack.push(index+8);
+            index=mem32(index+4)&0x00FFFFFF;
+            goto skippc;
+            break;
+        case 0xDF:
+            //puts("return");
+            if(stack.size() > 0)
+            {
+                index = stack.top();
+                stack.pop();
+                if(captures.size() > 0 and captures.back().depth == stack.size())
+                {
+                    auto done = captures.back();
+                    captures.pop_back();
+                    bool outermost = (captures.size() == 0);
+                    // a call that only changed state has nothing to share
+                    if(done.tris.size() == 0)
+                        goto skippc;
+                    
+                    subdlist * seen = NULL;
+                    auto & variants = m.variants[done.target];
+                    for(auto n : variants)
+                    {
+                        if(m.shared[n].tris == done.tris)
+                        {
+                            seen = &m.shared[n];
+                            break;
+                        }
+                    }
+                    if(!seen)
+                    {
+                        variants.push_back(m.shared.size());
+                        m.shared.push_back({done.target, 0, 0, done.tris});
+                        seen = &m.shared.back();
+                    }
+                    seen->refs++;
+                    
+                    // an enclosing capture needs the full output to compare
+                    // against its own earlier calls
+                    if(!outermost)
+                        captures.back().tris.insert(captures.back().tris.end(), done.tris.begin(), done.tris.end());
+                    else if(seen->refs > 1)
+                        seen->collapsed++;
+                    else
+                        for(auto & tri : done.tris)
+                            addtri(m, tri.a, tri.b, tri.c, tri.lit, tri.cull);
+                }
+                goto skippc;
+            }
+            else
+                return;
+            break;
+        }
+        index += 8;
+    }
+}
+
+// post-transform cache and overdraw optimisation of compiled meshes. only
+// triangles within a batch are reordered, so 0xD9 state is kept intact, and
+// coplanar triangles that overlap keep their dlist order among themselves
+
+#define FIFOSIZE 16 // cache size used to measure ACMR
+#define LRUSIZE 32 // cache size the forsyth scoring is tuned for
+
+// average cache miss ratio: transformed vertices per triangle
+float measureacmr(const std::vector<uint32_t> & indices, uint32_t first, uint32_t count)
+{
+    if(count == 0)
+        return 0;
+    uint32_t fifo[FIFOSIZE];
+    unsigned head = 0;
+    unsigned filled = 0;
+    unsigned misses = 0;
+    for(auto n = first; n < first+count; n++)
+    {
+        bool hit = false;
+        for(unsigned i = 0; i < filled; i++)
+            if(fifo[i] == indices[n])
+                hit = true;
+        if(hit)
+            continue;
+        misses++;
+        fifo[head] = indices[n];
+        head = (head+1)%FIFOSIZE;
+        if(filled < FIFOSIZE)
+            filled++;
+    }
+    return misses/(count/3.0f);
+}
+
+// rasterises the mesh in draw order from the six axis directions and returns
+// fragments passing the depth test per covered pixel
+float measureoverdraw(const mesh & m)
+{
+    const int res = 256;
+    
+    if(m.indices.size() == 0)
+        return 0;
+    
+    // bounds only from drawn vertices, so dropping unused ones doesn't
+    // change the scale between measurements
+    float low[3] = {1e9, 1e9, 1e9};
+    float high[3] = {-1e9, -1e9, -1e9};
+    for(auto n : m.indices)
+    {
+        auto & v = m.verts[n];
+        float p[3] = {float(v.x), float(v.y), float(v.z)};
+        for(int a = 0; a < 3; a++)
+        {
+            low[a] = fminf(low[a], p[a]);
+            high[a] = fmaxf(high[a], p[a]);
+        }
+    }
+    
+    std::vector<float> depth(res*res);
+    uint64_t shaded = 0;
+    uint64_t covered = 0;
+    for(int view = 0; view < 6; view++)
+    {
+        int a = view/2;
+        int ua = (a+1)%3;
+        int va = (a+2)%3;
+        float sign = (view&1) ? -1 : 1;
+        float uscale = (res-1)/fmaxf(high[ua]-low[ua], 1);
+        float vscale = (res-1)/fmaxf(high[va]-low[va], 1);
+        
+        std::fill(depth.begin(), depth.end(), -1e9f);
+        for(auto & b : m.batches)
+        {
+            for(auto n = b.first; n < b.first+b.count; n += 3)
+            {
+                float x[3], y[3], z[3];
+                for(int i = 0; i < 3; i++)
+                {
+                    auto & v = m.verts[m.indices[n+i]];
+                    float p[3] = {float(v.x), float(v.y), float(v.z)};
+                    // mirror u when looking from the other side to keep the winding meaningful
+                    x[i] = (sign > 0) ? (p[ua]-low[ua])*uscale : (high[ua]-p[ua])*uscale;
+                    y[i] = (p[va]-low[va])*vscale;
+                    z[i] = p[a]*sign;
+                }
+                float area = (x[1]-x[0])*(y[2]-y[0]) - (x[2]-x[0])*(y[1]-y[0]);
+                if(area == 0)
+                    continue;
+                if((b.cull & 1) and area > 0)
+                    continue;
+                if((b.cull & 2) and area < 0)
+                    continue;
+                
+                int minx = fmaxf(floorf(fminf(x[0], fminf(x[1], x[2]))), 0);
+                int maxx = fminf(ceilf(fmaxf(x[0], fmaxf(x[1], x[2]))), res-1);
+                int miny = fmaxf(floorf(fminf(y[0], fminf(y[1], y[2]))), 0);
+                int maxy = fminf(ceilf(fmaxf(y[0], fmaxf(y[1], y[2]))), res-1);
+                for(int py = miny; py <= maxy; py++)
+                {
+                    for(int px = minx; px <= maxx; px++)
+                    {
+                        float cx = px+0.5f;
+                        float cy = py+0.5f;
+                        float w0 = ((x[2]-x[1])*(cy-y[1]) - (y[2]-y[1])*(cx-x[1]))/area;
+                        float w1 = ((x[0]-x[2])*(cy-y[2]) - (y[0]-y[2])*(cx-x[2]))/area;
+                        float w2 = 1-w0-w1;
+                        if(w0 < 0 or w1 < 0 or w2 < 0)
+                            continue;
+                        float d = w0*z[0] + w1*z[1] + w2*z[2];
+                        if(d > depth[py*res+px])
+                        {
+                            depth[py*res+px] = d;
+                            shaded++;
+                        }
+                    }
+                }
+            }
+        }
+        for(auto d : depth)
+            if(d > -1e9f)
+                covered++;
+    }
+    return covered ? shaded/float(covered) : 0;
+}
+
+float forsythscore(int cachepos, unsigned remaining)
+{
+    if(remaining == 0)
+        return -1;
+    float score = 0;
+    if(cachepos >= 0)
+    {
+        if(cachepos < 3)
+            score = 0.75f;
+        else
+            score = powf(1.0f - (cachepos-3)/float(LRUSIZE-3), 1.5f);
+    }
+    return score + 2.0f/sqrtf(remaining);
+}
+
+// Tom Forsyth's linear-speed vertex cache optimisation
+void optimizevertexcache(mesh & m, batch & b)
+{
+    unsigned tricount = b.count/3;
+    if(tricount < 2)
+        return;
+    
+    // local vertex numbering for this batch
+    std::map<uint32_t, uint32_t> local;
+    std::vector<uint32_t> tris(b.count);
+    for(unsigned n = 0; n < b.count; n++)
+    {
+        auto found = local.find(m.indices[b.first+n]);
+        if(found == local.end())
+            found = local.insert({m.indices[b.first+n], (uint32_t)local.size()}).first;
+        tris[n] = found->second;
+    }
+    unsigned vertcount = local.size();
+    
+    std::vector<unsigned> remaining(vertcount);
+    for(auto v : tris)
+        remaining[v]++;
+    std::vector<unsigned> adjstart(vertcount+1);
+    for(unsigned v = 0; v < vertcount; v++)
+        adjstart[v+1] = adjstart[v] + remaining[v];
+    std::vector<unsigned> adjacency(b.count);
+    std::vector<unsigned> adjfill(adjstart.begin(), adjstart.end()-1);
+    for(unsigned t = 0; t < tricount; t++)
+        for(int i = 0; i < 3; i++)
+            adjacency[adjfill[tris[t*3+i]]++] = t;
+    
+    std::vector<int> cachepos(vertcount, -1);
+    std::vector<float> vertscore(vertcount);
+    for(unsigned v = 0; v < vertcount; v++)
+        vertscore[v] = forsythscore(-1, remaining[v]);
+    std::vector<float> triscore(tricount);
+    std::vector<bool> added(tricount);
+    int best = 0;
+    for(unsigned t = 0; t < tricount; t++)
+    {
+        triscore[t] = vertscore[tris[t*3]] + vertscore[tris[t*3+1]] + vertscore[tris[t*3+2]];
+        if(triscore[t] > triscore[best])
+            best = t;
+    }
+    
+    std::vector<uint32_t> cache;
+    std::vector<uint32_t> output;
+    unsigned cursor = 0;
+    while(output.size() < b.count)
+    {
+        if(best < 0)
+        {
+            while(added[cursor])
+                cursor++;
+            best = cursor;
+        }
+        added[best] = true;
+        
+        std::vector<uint32_t> newcache;
+        for(int i = 0; i < 3; i++)
+        {
+            uint32_t v = tris[best*3+i];
+            output.push_back(v);
+            newcache.push_back(v);
+            
+            // drop the triangle from this vertex's remaining adjacency
+            for(unsigned n = adjstart[v]; n < adjstart[v]+remaining[v]; n++)
+            {
+                if(adjacency[n] == (unsigned)best)
+                {
+                    std::swap(adjacency[n], adjacency[adjstart[v]+remaining[v]-1]);
+                    break;
+                }
+            }
+            remaining[v]--;
+        }
+        for(auto v : cache)
+            if(v != newcache[0] and v != newcache[1] and v != newcache[2])
+                newcache.push_back(v);
+        for(unsigned n = LRUSIZE; n < newcache.size(); n++)
+        {
+            cachepos[newcache[n]] = -1;
+            vertscore[newcache[n]] = forsythscore(-1, remaining[newcache[n]]);
+        }
+        if(newcache.size() > LRUSIZE)
+            newcache.resize(LRUSIZE);
+        for(unsigned n = 0; n < newcache.size(); n++)
+        {
+            cachepos[newcache[n]] = n;
+            vertscore[newcache[n]] = forsythscore(n, remaining[newcache[n]]);
+        }
+        cache = newcache;
+        
+        best = -1;
+        float bestscore = -1;
+        for(auto v : cache)
+        {
+            for(unsigned n = adjstart[v]; n < adjstart[v]+remaining[v]; n++)
+            {
+                unsigned t = adjacency[n];
+                triscore[t] = vertscore[tris[t*3]] + vertscore[tris[t*3+1]] + vertscore[tris[t*3+2]];
+                if(triscore[t] > bestscore)
+                {
+                    bestscore = triscore[t];
+                    best = t;
+                }
+            }
+        }
+    }
+    
+    std::vector<uint32_t> global(vertcount);
+    for(auto & pair : local)
+        global[pair.second] = pair.first;
+    for(unsigned n = 0; n < b.count; n++)
+        m.indices[b.first+n] = global[output[n]];
+}
+
+struct cluster
+{
+    uint32_t first; // offset into mesh::indices
+    uint32_t count;
+    float sortkey;
+};
+
+// splits a cache-optimised batch where the cache starts over anyway, or
+// where a cluster has paid off its own cold cache, and draws the clusters
+// facing away from the batch's centre first, since those tend to occlude the
+// rest
+void optimizeoverdraw(mesh & m, batch & b)
+{
+    const float threshold = 1.05f; // allowed ACMR cost of cutting clusters
+    
+    unsigned tricount = b.count/3;
+    if(tricount < 2)
+        return;
+    
+    float batchacmr = measureacmr(m.indices, b.first, b.count);
+    
+    // the batch's own cache decides hard boundaries, a cache that starts
+    // cold with each cluster decides soft ones
+    struct fifocache
+    {
+        uint32_t entries[FIFOSIZE];
+        unsigned head = 0;
+        unsigned filled = 0;
+        bool miss(uint32_t v)
+        {
+            for(unsigned n = 0; n < filled; n++)
+                if(entries[n] == v)
+                    return false;
+            entries[head] = v;
+            head = (head+1)%FIFOSIZE;
+            if(filled < FIFOSIZE)
+                filled++;
+            return true;
+        }
+    };
+    fifocache batchcache;
+    fifocache clustercache;
+    
+    std::vector<cluster> clusters;
+    unsigned clustermisses = 0;
+    for(unsigned t = 0; t < tricount; t++)
+    {
+        unsigned misses = 0;
+        for(int i = 0; i < 3; i++)
+            misses += batchcache.miss(m.indices[b.first+t*3+i]);
+        
+        bool hard = (misses == 3);
+        bool soft = clusters.size() > 0
+                and clustermisses/(clusters.back().count/3.0f) <= batchacmr*threshold;
+        if(t == 0 or hard or soft)
+        {
+            clusters.push_back({b.first+t*3, 0, 0});
+            clustercache = fifocache();
+            clustermisses = 0;
+        }
+        clusters.back().count += 3;
+        for(int i = 0; i < 3; i++)
+            clustermisses += clustercache.miss(m.indices[b.first+t*3+i]);
+    }
+    if(clusters.size() < 2)
+        return;
+    
+    float centre[3] = {0, 0, 0};
+    for(unsigned n = b.first; n < b.first+b.count; n++)
+    {
+        centre[0] += m.verts[m.indices[n]].x;
+        centre[1] += m.verts[m.indices[n]].y;
+        centre[2] += m.verts[m.indices[n]].z;
+    }
+    for(int a = 0; a < 3; a++)
+        centre[a] /= b.count;
+    
+    for(auto & c : clusters)
+    {
+        float position[3] = {0, 0, 0};
+        float normal[3] = {0, 0, 0};
+        float area = 0;
+        for(unsigned n = c.first; n < c.first+c.count; n += 3)
+        {
+            auto & v0 = m.verts[m.indices[n]];
+            auto & v1 = m.verts[m.indices[n+1]];
+            auto & v2 = m.verts[m.indices[n+2]];
+            float e1[3] = {float(v1.x-v0.x), float(v1.y-v0.y), float(v1.z-v0.z)};
+            float e2[3] = {float(v2.x-v0.x), float(v2.y-v0.y), float(v2.z-v0.z)};
+            float cross[3] = { e1[1]*e2[2] - e1[2]*e2[1]
+                             , e1[2]*e2[0] - e1[0]*e2[2]
+                             , e1[0]*e2[1] - e1[1]*e2[0] };
+            float triarea = sqrtf(cross[0]*cross[0] + cross[1]*cross[1] + cross[2]*cross[2]);
+            position[0] += (v0.x+v1.x+v2.x)/3.0f*triarea;
+            position[1] += (v0.y+v1.y+v2.y)/3.0f*triarea;
+            position[2] += (v0.z+v1.z+v2.z)/3.0f*triarea;
+            for(int a = 0; a < 3; a++)
+                normal[a] += cross[a];
+            area += triarea;
+        }
+        float length = sqrtf(normal[0]*normal[0] + normal[1]*normal[1] + normal[2]*normal[2]);
+        if(area == 0 or length == 0)
+            continue;
+        for(int a = 0; a < 3; a++)
+            c.sortkey += (position[a]/area - centre[a]) * normal[a]/length;
+    }
+    
+    std::stable_sort(clusters.begin(), clusters.end(),
+        [](const cluster & l, const cluster & r) { return l.sortkey > r.sortkey; });
+    
+    std::vector<uint32_t> output;
+    for(auto & c : clusters)
+        output.insert(output.end(), m.indices.begin()+c.first, m.indices.begin()+c.first+c.count);
+    std::copy(output.begin(), output.end(), m.indices.begin()+b.first);
+}
+
+// renumbers vertices in the order they're first drawn, dropping unused ones
+void optimizevertexfetch(mesh & m)
+{
+    std::vector<int64_t> remap(m.verts.size(), -1);
+    std::vector<vertex> verts;
+    for(auto & n : m.indices)
+    {
+        if(remap[n] < 0)
+        {
+            remap[n] = verts.size();
+            verts.push_back(m.verts[n]);
+        }
+        n = remap[n];
+    }
+    m.verts = verts;
+    
+    for(auto it = m.lookup.begin(); it != m.lookup.end(); )
+    {
+        if(remap[it->second] < 0)
+            it = m.lookup.erase(it);
+        else
+        {
+            it->second = remap[it->second];
+            it++;
+        }
+    }
+    for(auto & sub : m.shared)
+    {
+        for(auto & tri : sub.tris)
+        {
+            tri.a = remap[tri.a];
+            tri.b = remap[tri.b];
+            tri.c = remap[tri.c];
+        }
+    }
+}
+
+int64_t gcd64(int64_t a, int64_t b)
+{
+    while(b != 0)
+    {
+        auto r = a%b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+struct planetri
+{
+    uint32_t tri; // triangle number within the batch
+    int64_t u[3]; // corners projected onto the plane's two flattest axes
+    int64_t v[3];
+    int64_t low[2];
+    int64_t high[2];
+};
+
+// true if the interiors overlap; triangles that only touch along an edge or
+// at a corner, like neighbouring floor triangles, don't
+bool planetrisoverlap(const planetri & a, const planetri & b)
+{
+    if(a.high[1] <= b.low[1] or b.high[1] <= a.low[1])
+        return false;
+    for(auto t : {&a, &b})
+    {
+        for(int e = 0; e < 3; e++)
+        {
+            // separating axis test against each edge normal
+            int64_t nu = -(t->v[(e+1)%3] - t->v[e]);
+            int64_t nv = t->u[(e+1)%3] - t->u[e];
+            int64_t low[2] = {INT64_MAX, INT64_MAX};
+            int64_t high[2] = {INT64_MIN, INT64_MIN};
+            const planetri * both[2] = {&a, &b};
+            for(int i = 0; i < 2; i++)
+            {
+                for(int c = 0; c < 3; c++)
+                {
+                    int64_t d = both[i]->u[c]*nu + both[i]->v[c]*nv;
+                    low[i] = std::min(low[i], d);
+                    high[i] = std::max(high[i], d);
+                }
+            }
+            if(high[0] <= low[1] or high[1] <= low[0])
+                return false;
+        }
+    }
+    return true;
+}
+
+// vertex coloured decals over a floor and the like are coplanar with what
+// they cover, so only drawing them after it in dlist order makes them show.
+// returns groups of triangle numbers, in dlist order, that have to stay in
+// that order; vertex positions are integers so coplanarity is exact
+std::vector<std::vector<uint32_t>> findcoplanar(const mesh & m, const batch & b)
+{
+    std::map<std::tuple<int64_t, int64_t, int64_t, int64_t>, std::vector<planetri>> planes;
+    for(uint32_t t = 0; t < b.count/3; t++)
+    {
+        int64_t p[3][3];
+        for(int i = 0; i < 3; i++)
+        {
+            auto & v = m.verts[m.indices[b.first+t*3+i]];
+            p[i][0] = v.x;
+            p[i][1] = v.y;
+            p[i][2] = v.z;
+        }
+        int64_t e1[3], e2[3];
+        for(int a = 0; a < 3; a++)
+        {
+            e1[a] = p[1][a]-p[0][a];
+            e2[a] = p[2][a]-p[0][a];
+        }
+        int64_t n[3] = { e1[1]*e2[2] - e1[2]*e2[1]
+                       , e1[2]*e2[0] - e1[0]*e2[2]
+                       , e1[0]*e2[1] - e1[1]*e2[0] };
+        int64_t divisor = gcd64(gcd64(llabs(n[0]), llabs(n[1])), llabs(n[2]));
+        if(divisor == 0)
+            continue; // degenerate, covers nothing
+        // either facing gives the same plane
+        int first = (n[0] != 0) ? 0 : (n[1] != 0) ? 1 : 2;
+        if(n[first] < 0)
+            divisor = -divisor;
+        int axis = 0;
+        for(int a = 0; a < 3; a++)
+        {
+            n[a] /= divisor;
+            if(llabs(n[a]) > llabs(n[axis]))
+                axis = a;
+        }
+        int64_t d = n[0]*p[0][0] + n[1]*p[0][1] + n[2]*p[0][2];
+        
+        planetri pt;
+        pt.tri = t;
+        for(int i = 0; i < 3; i++)
+        {
+            pt.u[i] = p[i][(axis+1)%3];
+            pt.v[i] = p[i][(axis+2)%3];
+        }
+        pt.low[0] = std::min({pt.u[0], pt.u[1], pt.u[2]});
+        pt.low[1] = std::min({pt.v[0], pt.v[1], pt.v[2]});
+        pt.high[0] = std::max({pt.u[0], pt.u[1], pt.u[2]});
+        pt.high[1] = std::max({pt.v[0], pt.v[1], pt.v[2]});
+        planes[std::make_tuple(n[0], n[1], n[2], d)].push_back(pt);
+    }
+    
+    // union-find over the triangles that overlap another in their plane
+    std::vector<uint32_t> parent(b.count/3);
+    for(uint32_t t = 0; t < parent.size(); t++)
+        parent[t] = t;
+    auto root = [&](uint32_t t)
+    {
+        while(parent[t] != t)
+            t = parent[t] = parent[parent[t]];
+        return t;
+    };
+    std::vector<bool> overlaps(b.count/3);
+    for(auto & plane : planes)
+    {
+        auto & tris = plane.second;
+        if(tris.size() < 2)
+            continue;
+        // sweep along u so only triangles whose bounds meet get tested
+        std::sort(tris.begin(), tris.end(), [](const planetri & a, const planetri & b)
+            { return a.low[0] < b.low[0]; });
+        for(unsigned i = 0; i < tris.size(); i++)
+        {
+            for(unsigned j = i+1; j < tris.size() and tris[j].low[0] < tris[i].high[0]; j++)
+            {
+                if(!planetrisoverlap(tris[i], tris[j]))
+                    continue;
+                parent[root(tris[i].tri)] = root(tris[j].tri);
+                overlaps[tris[i].tri] = true;
+                overlaps[tris[j].tri] = true;
+            }
+        }
+    }
+    
+    std::map<uint32_t, std::vector<uint32_t>> groups;
+    for(uint32_t t = 0; t < parent.size(); t++)
+        if(overlaps[t])
+            groups[root(t)].push_back(t);
+    std::vector<std::vector<uint32_t>> out;
+    for(auto & group : groups)
+        out.push_back(group.second);
+    return out;
+}
+
+// after a batch has been reordered, puts each group from findcoplanar back in
+// dlist order within the positions its triangles ended up at. original is
+// m.indices from before any reordering
+void keepcoplanarorder(mesh & m, const batch & b, const std::vector<std::vector<uint32_t>> & groups, const std::vector<uint32_t> & original)
+{
+    if(groups.size() == 0)
+        return;
+    typedef std::tuple<uint32_t, uint32_t, uint32_t> corners;
+    auto cornersof = [&](const std::vector<uint32_t> & indices, uint32_t at)
+        { return std::make_tuple(indices[at], indices[at+1], indices[at+2]); };
+    // reordering keeps each triangle's corners as they were
+    std::map<corners, std::vector<uint32_t>> where;
+    for(uint32_t t = b.count/3; t > 0; t--)
+        where[cornersof(m.indices, b.first+(t-1)*3)].push_back(t-1);
+    for(auto & group : groups)
+    {
+        std::vector<uint32_t> positions;
+        for(auto t : group)
+        {
+            auto & found = where[cornersof(original, b.first+t*3)];
+            positions.push_back(found.back());
+            found.pop_back();
+        }
+        std::sort(positions.begin(), positions.end());
+        for(unsigned n = 0; n < group.size(); n++)
+            for(int i = 0; i < 3; i++)
+                m.indices[b.first+positions[n]*3+i] = original[b.first+group[n]*3+i];
+    }
+}
+
+void optimizemesh(mesh & m)
+{
+    float acmr = measureacmr(m.indices, 0, m.indices.size());
+    float overdraw = measureoverdraw(m);
+    
+    #define report(step) \
+        { \
+            float newacmr = measureacmr(m.indices, 0, m.indices.size()); \
+            float newoverdraw = measureoverdraw(m); \
+            printf("%s: ACMR %.3f -> %.3f, overdraw %.3f -> %.3f\n" \
+                , step, acmr, newacmr, overdraw, newoverdraw); \
+            acmr = newacmr; \
+            overdraw = newoverdraw; \
+        }
+    
+    auto original = m.indices;
+    std::vector<std::vector<std::vector<uint32_t>>> coplanar;
+    for(auto & b : m.batches)
+        coplanar.push_back(findcoplanar(m, b));
+    
+    for(unsigned n = 0; n < m.batches.size(); n++)
+    {
+        optimizevertexcache(m, m.batches[n]);
+        keepcoplanarorder(m, m.batches[n], coplanar[n], original);
+    }
+    report("Vertex cache");
+    
+    auto cacheorder = m.indices;
+    for(unsigned n = 0; n < m.batches.size(); n++)
+    {
+        optimizeoverdraw(m, m.batches[n]);
+        keepcoplanarorder(m, m.batches[n], coplanar[n], original);
+    }
+    if(measureoverdraw(m) > overdraw)
+        m.indices = cacheorder; // the centre heuristic didn't pay off for this map
+    report("Overdraw");
+    
+    optimizevertexfetch(m);
+    report("Vertex fetch");
+    
+    #undef report
+}
+
+void uploadmesh(mesh & m)
+{
+    glGenBuffers(1, &m.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, m.vbo);
+    glBufferData(GL_ARRAY_BUFFER, m.verts.size()*sizeof(vertex), m.verts.data(), GL_STATIC_DRAW);
+    glGenBuffers(1, &m.ibo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m.ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, m.indices.size()*sizeof(uint32_t), m.indices.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+// one line per vertex used by lit triangles, for the viewer's normal overlay
+void uploadnormals(mesh & m)
+{
+    std::vector<bool> lit(m.verts.size());
+    for(auto & b : m.batches)
+        if(b.lit)
+            for(auto n = b.first; n < b.first+b.count; n++)
+                lit[m.indices[n]] = true;
+    
+    std::vector<float> lines;
+    for(unsigned n = 0; n < m.verts.size(); n++)
+    {
+        if(!lit[n])
+            continue;
+        auto & v = m.verts[n];
+        lines.insert(lines.end(),
+            { float(v.x), float(v.y), float(v.z)
+            , v.x+v.i*0.1f, v.y+v.j*0.1f, v.z+v.k*0.1f });
+    }
+    m.normalcount = lines.size()/3;
+    glGenBuffers(1, &m.normalvbo);
+    glBindBuffer(GL_ARRAY_BUFFER, m.normalvbo);
+    glBufferData(GL_ARRAY_BUFFER, lines.size()*sizeof(float), lines.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+void freemesh(mesh & m)
+{
+    glDeleteBuffers(1, &m.vbo);
+    glDeleteBuffers(1, &m.ibo);
+    glDeleteBuffers(1, &m.normalvbo);
+    m.vbo = 0;
+    m.ibo = 0;
+    m.normalvbo = 0;
+}
+
+void drawmesh(mesh & m, GLint uniform_lit)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, m.vbo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m.ibo);
+    
+    #define attrib(slot, size, type, normalized, member) \
+        glEnableVertexAttribArray(slot); \
+        glVertexAttribPointer(slot, size, type, normalized, sizeof(vertex), (void*)offsetof(vertex, member))
+    
+    attrib(attrib_position, 3, GL_SHORT, GL_FALSE, x);
+    attrib(attrib_uv, 2, GL_SHORT, GL_FALSE, u);
+    attrib(attrib_normal, 3, GL_BYTE, GL_TRUE, i);
+    attrib(attrib_color, 4, GL_UNSIGNED_BYTE, GL_TRUE, i);
+    
+    #undef attrib
+    
+    for(auto & b : m.batches)
+    {
+        glUniform1i(uniform_lit, b.lit);
+        switch(b.cull)
+        {
+        case 0:
+            glDisable(GL_CULL_FACE); break;
+        case 1:
+            glEnable(GL_CULL_FACE); glCullFace(GL_FRONT); break;
+        case 2:
+            glEnable(GL_CULL_FACE); glCullFace(GL_BACK); break;
+        case 3:
+            glEnable(GL_CULL_FACE); glCullFace(GL_FRONT_AND_BACK); break;
+        }
+        glDrawElements(GL_TRIANGLES, b.count, GL_UNSIGNED_INT, (void*)(b.first*sizeof(uint32_t)));
+    }
+    glDisable(GL_CULL_FACE);
+    
+    glDisableVertexAttribArray(attrib_position);
+    glDisableVertexAttribArray(attrib_uv);
+    glDisableVertexAttribArray(attrib_normal);
+    glDisableVertexAttribArray(attrib_color);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+// reads a zmap and compiles its opaque dlists into m
+bool loadzmap(const char * filename, mesh & m)
+{
+    std::vector<dlistpointer> opaque_dlists;
+    std::vector<dlistpointer> glassy_dlists;
+    
+    unsigned index = 0;
+    auto file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        puts("Could not open file.");
+        return false;
+    }
+    printf("Loading map %s", filename);
+    
+    fseek(file, 0, SEEK_END);
+    auto filesize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    
+    // zmaps are addressed through 24 bit segment offsets
+    if(filesize <= 0 or filesize > 0x01000000)
+    {   puts("Bad file size."); fclose(file); return false; }
+    
+    currentzmap = (char*)malloc(filesize);
+    if(currentzmap == NULL)
+    {   puts("Out of memory."); fclose(file); return false; }
+    
+    if(fread(currentzmap, 1, filesize, file) != (size_t)filesize)
+    {   puts("Could not read file."); fclose(file); free(currentzmap); return false; }
+    
+    fclose(file);
+    
+    currentsize = filesize;
+    badzmap = false;
+    
+    
+    
+    bool breakout = false;
+    
+    unsigned meshaddress = 0;
+    
+    while(breakout == false and !badzmap)
+    {
+        switch (mem8(index))
+        {
+        case 0x00:
+            puts("Start positions"); break;
+        case 0x01:
+            puts("Actor list"); break;
+        case 0x02:
+            puts("Cameras"); break;
+        case 0x03:
+            puts("Collision"); break;
+        case 0x04:
+            puts("Maplist"); break;
+        case 0x05:
+            puts("Wind info"); break;
+        case 0x06:
+            puts("Entrance list"); break;
+        case 0x07:
+            puts("Special objects"); break;
+        case 0x08:
+            puts("Room behavior"); break;
+        case 0x09:
+            puts("Unused?"); break;
+        case 0x0A:
+            meshaddress = mem32(index+4);
+            printf("Mesh address %08X\n", meshaddress); break;
+        case 0x0B:
+            puts("Object list"); break;
+        case 0x0C:
+            puts("Unused env settings"); break;
+        case 0x0D:
+            puts("Paths"); break;
+        case 0x0E:
+            puts("Transition actor list"); break;
+        case 0x0F:
+            puts("Env settings"); break;
+        case 0x10:
+            puts("Time settings"); break;
+        case 0x11:
+            puts("Skybox settings"); break;
+        case 0x12:
+            puts("Skybox modifier"); break;
+        case 0x13:
+            puts("Exit List"); break;
+        case 0x14:
+            puts("End of header"); breakout = true; break;
+        case 0x15:
+            puts("Sound settings (scene)"); break;
+        case 0x16:
+            puts("Sound settings (room)"); break;
+        case 0x17:
+            puts("Cutscenes"); break;
+        case 0x18:
+            puts("Extra headers"); break;
+        case 0x19:
+            puts("Camera, world map"); break;
+        default:
+            puts("Unknown");
+        }
+        index += 8;
+    }
+    
+    if(badzmap)
+    {   puts("Header runs past the end of the file."); free(currentzmap); return false; }
+    
+    if(meshaddress>>24 != 0x03)
+    {   printf("Unsupported mesh header bank. %02X",meshaddress>>24); free(currentzmap); return false; }
+    
+    
+    
+    uint8_t count;
+    uint32_t start;
+    uint32_t end;
+    
+    index = meshaddress&0x00FFFFFF;
+    
+    int meshtype = -1;
+    
+    switch (mem8(index))
+    {
+    case 0x00:
+    case 0x02:
+        count = mem8(index+1);
+        start = mem32(index+4);
+        end = mem32(index+8);
+        puts("Found the meshes");
+        meshtype = mem8(index);
+        break;
+    default:
+        puts("Unsupported mesh type in mesh header."); printf("%08X\n",index); free(currentzmap); return false;
+    }
+    
+    if(start>>24 != 0x03)
+    {   printf("Unsupported mesh data bank. %02X",start>>24); free(currentzmap); return false; }
+    printf("%d\n", count);
+    
+    index = start&0x00FFFFFF;
+    
+    if(meshtype == 0)
+    {
+        for(auto i = 0; i < count; i++)
+        {
+            if(mem8(index) == 0x03)
+                opaque_dlists.push_back({currentzmap, mem32(index)&0x00FFFFFF});
+            if(mem8(index+4) == 0x03)
+                glassy_dlists.push_back({currentzmap, mem32(index+4)&0x00FFFFFF});
+            index += 8;
+        }
+        puts("Installed dlists");
+    }
+    if(meshtype == 2)
+    {
+        for(auto i = 0; i <= count; i++)
+        {
+            if(mem8(index+8) == 0x03)
+                opaque_dlists.push_back({currentzmap, mem32(index+8)&0x00FFFFFF});
+            if(mem8(index+12) == 0x03)
+                glassy_dlists.push_back({currentzmap, mem32(index+12)&0x00FFFFFF});
+            index += 16;
+        }
+        puts("Installed dlists");
+    }
+    
+    if(badzmap)
+    {   puts("Mesh header runs past the end of the file."); free(currentzmap); return false; }
+    
+    m.dlists = opaque_dlists.size();
+    for(auto list : opaque_dlists)
+        countcalls(m, list.offset);
+    for(auto list : opaque_dlists)
+        compiledlist(m, list.offset);
+    if(badzmap)
+    {   puts("A dlist runs past the end of the file or nests too deep."); free(currentzmap); return false; }
+    printf("Compiled %d triangles, %d vertices, %d batches\n"
+        , (int)m.indices.size()/3
+        , (int)m.verts.size()
+        , (int)m.batches.size());
+    
+    sharestats stats = getsharestats(m);
+    printf("Shared %d sub-dlists: %d calls collapsed, %d triangles shared, %d triangles not redrawn\n"
+        , stats.shared, stats.collapsed, stats.sharedtris, stats.skippedtris);
+    
+    optimizemesh(m);
+    
+    // everything needed from the file is in the mesh now
+    free(currentzmap);
+    currentzmap = NULL;
+    return true;
+}
+
+#ifndef _WIN32
+
+// Server mode keeps scenes compiled and on the GPU, and serves one-line
+// requests over a Unix domain socket. Every request gets exactly one line
+// back, starting with "ok" or "error":
+//   load <scene> <file.zmap> [more.zmap...]  ok <triangles> <vertices>
+//   unload <scene>                           ok
+//   render <scene> <width> <height> <x> <y> <z> <yaw> <pitch>
+//                                            ok <shm name> <width> <height> <bytes>
+//   stats <scene>                            ok <triangles> <vertices> <batches> <shared> <collapsed>
+//                                               <shared triangles> <triangles not redrawn>
+//   raycast <scene> <x> <y> <z> <dx> <dy> <dz>
+//                                            ok hit <distance> <x> <y> <z> / ok miss
+//   shutdown                                 ok
+// Positions use the viewer's axes (x and y across, z up) and angles are in
+// degrees like the viewer's camera. Frames are RGBA8, bottom row first, in a
+// POSIX shared memory object that belongs to the connection and holds the
+// latest frame until its next render.
+// Connections each get a reader thread that only splits lines; all work
+// happens in order on the thread that owns the GL context. Reader threads are
+// joined when their client hangs up, and all of them on shutdown, so none
+// outlive the job queue.
+
+struct job
+{
+    int client;
+    std::string line; // empty when the client hung up
+};
+
+std::mutex jobmutex;
+std::condition_variable jobready;
+std::deque<job> jobs;
+
+void pushjob(int client, const std::string & line)
+{
+    std::lock_guard<std::mutex> lock(jobmutex);
+    jobs.push_back({client, line});
+    jobready.notify_one();
+}
+
+std::atomic<bool> stopping(false);
+std::mutex readermutex;
+std::map<int, std::thread> readers;
+
+void readclient(int fd)
+{
+    std::string pending;
+    char buffer[4096];
+    while(1)
+    {
+        auto got = read(fd, buffer, sizeof(buffer));
+        if(got < 0 and errno == EINTR)
+            continue;
+        if(got <= 0)
+            break;
+        pending.append(buffer, got);
+        size_t end;
+        while((end = pending.find('\n')) != std::string::npos)
+        {
+            auto line = pending.substr(0, end);
+            pending.erase(0, end+1);
+            if(line.size() > 0 and line.back() == '\r')
+                line.pop_back();
+            if(line.size() > 0)
+                pushjob(fd, line);
+        }
+    }
+    pushjob(fd, "");
+}
+
+void acceptclients(int listener)
+{
+    while(1)
+    {
+        int fd = accept(listener, NULL, NULL);
+        if(stopping)
+        {
+            if(fd >= 0)
+                close(fd);
+            return;
+        }
+        if(fd < 0 and (errno == EINTR or errno == ECONNABORTED))
+            continue;
+        if(fd < 0)
+        {
+            printf("accept failed: %s\n", strerror(errno));
+            return;
+        }
+        std::lock_guard<std::mutex> lock(readermutex);
+        readers[fd] = std::thread(readclient, fd);
+    }
+}
+
+// per-connection frame buffer in shared memory
+struct connection
+{
+    std::string shmname;
+    int shmfd = -1;
+    void * frame = NULL;
+    size_t framesize = 0;
+};
+
+void closeconnection(connection & c)
+{
+    if(c.frame)
+        munmap(c.frame, c.framesize);
+    if(c.shmfd >= 0)
+    {
+        close(c.shmfd);
+        shm_unlink(c.shmname.c_str());
+    }
+}
+
+void respond(int fd, const char * format, ...)
+{
+    char line[1024];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line)-1, format, args);
+    va_end(args);
+    if(length < 0)
+        return;
+    if(length > (int)sizeof(line)-2)
+        length = sizeof(line)-2;
+    line[length++] = '\n';
+    for(int sent = 0; sent < length; )
+    {
+        auto got = send(fd, line+sent, length-sent, MSG_NOSIGNAL);
+        if(got < 0 and errno == EINTR)
+            continue;
+        if(got <= 0)
+            return; // the reader thread will notice the hangup
+        sent += got;
+    }
+}
+
+#define BVHLEAFTRIS 4
+
+struct bvhbuild
+{
+    float low[3];
+    float high[3];
+    float center[3];
+};
+
+uint32_t buildbvhnode(mesh & m, std::vector<bvhbuild> & bounds, uint32_t first, uint32_t last)
+{
+    uint32_t index = m.bvh.size();
+    m.bvh.push_back(bvhnode());
+    bvhnode node;
+    float centerlow[3], centerhigh[3];
+    for(int a = 0; a < 3; a++)
+    {
+        node.low[a] = centerlow[a] = INFINITY;
+        node.high[a] = centerhigh[a] = -INFINITY;
+    }
+    for(auto n = first; n < last; n++)
+    {
+        auto & b = bounds[m.bvhtris[n]];
+        for(int a = 0; a < 3; a++)
+        {
+            node.low[a] = fminf(node.low[a], b.low[a]);
+            node.high[a] = fmaxf(node.high[a], b.high[a]);
+            centerlow[a] = fminf(centerlow[a], b.center[a]);
+            centerhigh[a] = fmaxf(centerhigh[a], b.center[a]);
+        }
+    }
+    if(last-first <= BVHLEAFTRIS)
+    {
+        node.start = first;
+        node.count = last-first;
+        m.bvh[index] = node;
+        return index;
+    }
+    // split at the median along the axis the centers spread over most
+    int axis = 0;
+    for(int a = 1; a < 3; a++)
+        if(centerhigh[a]-centerlow[a] > centerhigh[axis]-centerlow[axis])
+            axis = a;
+    auto middle = first + (last-first)/2;
+    std::nth_element(m.bvhtris.begin()+first, m.bvhtris.begin()+middle, m.bvhtris.begin()+last,
+        [&](uint32_t a, uint32_t b) { return bounds[a].center[axis] < bounds[b].center[axis]; });
+    buildbvhnode(m, bounds, first, middle);
+    node.start = buildbvhnode(m, bounds, middle, last);
+    node.count = 0;
+    m.bvh[index] = node;
+    return index;
+}
+
+void buildbvh(mesh & m)
+{
+    uint32_t tris = m.indices.size()/3;
+    m.bvh.clear();
+    m.bvhtris.resize(tris);
+    if(tris == 0)
+        return;
+    std::vector<bvhbuild> bounds(tris);
+    for(uint32_t n = 0; n < tris; n++)
+    {
+        m.bvhtris[n] = n;
+        auto & b = bounds[n];
+        for(int a = 0; a < 3; a++)
+        {
+            b.low[a] = INFINITY;
+            b.high[a] = -INFINITY;
+        }
+        for(int i = 0; i < 3; i++)
+        {
+            auto & v = m.verts[m.indices[n*3+i]];
+            float p[3] = {(float)v.x, (float)v.y, (float)v.z};
+            for(int a = 0; a < 3; a++)
+            {
+                b.low[a] = fminf(b.low[a], p[a]);
+                b.high[a] = fmaxf(b.high[a], p[a]);
+            }
+        }
+        for(int a = 0; a < 3; a++)
+            b.center[a] = (b.low[a]+b.high[a])/2;
+    }
+    m.bvh.reserve(tris/BVHLEAFTRIS*2+1);
+    buildbvhnode(m, bounds, 0, tris);
+}
+
+// Möller–Trumbore; distance is along dir, which needn't be normalized
+bool raytri(const mesh & m, uint32_t tri, const float origin[3], const float dir[3], float & distance)
 {
-    return swap32(*(uint32_t*)(currentzmap+addr));
+    float p[3][3];
+    for(int i = 0; i < 3; i++)
+    {
+        auto & v = m.verts[m.indices[tri*3+i]];
+        p[i][0] = v.x;
+        p[i][1] = v.y;
+        p[i][2] = v.z;
+    }
+    float e1[3], e2[3], s[3];
+    for(int a = 0; a < 3; a++)
+    {
+        e1[a] = p[1][a]-p[0][a];
+        e2[a] = p[2][a]-p[0][a];
+        s[a] = origin[a]-p[0][a];
+    }
+    float h[3] = { dir[1]*e2[2] - dir[2]*e2[1]
+                 , dir[2]*e2[0] - dir[0]*e2[2]
+                 , dir[0]*e2[1] - dir[1]*e2[0] };
+    float det = e1[0]*h[0] + e1[1]*h[1] + e1[2]*h[2];
+    if(fabsf(det) < 1e-9f)
+        return false;
+    float u = (s[0]*h[0] + s[1]*h[1] + s[2]*h[2])/det;
+    if(u < 0 or u > 1)
+        return false;
+    float q[3] = { s[1]*e1[2] - s[2]*e1[1]
+                 , s[2]*e1[0] - s[0]*e1[2]
+                 , s[0]*e1[1] - s[1]*e1[0] };
+    float v = (dir[0]*q[0] + dir[1]*q[1] + dir[2]*q[2])/det;
+    if(v < 0 or u+v > 1)
+        return false;
+    float t = (e2[0]*q[0] + e2[1]*q[1] + e2[2]*q[2])/det;
+    if(t < 0)
+        return false;
+    distance = t;
+    return true;
 }
 
-struct vertex
+// slab test, true if the ray enters the box before limit
+bool raybox(const bvhnode & node, const float origin[3], const float inverse[3], float limit)
 {
-    int16_t x = 0;
-    int16_t y = 0;
-    int16_t z = 0;
-    //uint16_t nothing = 0;
-    
-    int16_t u = 0;
-    int16_t v = 0;
-    
-    int8_t i = 0;
-    int8_t j = 0;
-    int8_t k = 0;
-    int8_t l = 0;
-    vertex() { }
-    vertex(uint32_t addr, bool print)
+    float near = 0;
+    float far = limit;
+    for(int a = 0; a < 3; a++)
     {
-        uint32_t rawdata = mem32(addr);
-        x = (rawdata & 0xFFFF0000)
-                     / 0x00010000;
-        y = (rawdata & 0x0000FFFF)
-                     / 0x00000001;
-        rawdata = mem32(addr+4);
-        z = (rawdata & 0xFFFF0000)
-                     / 0x00010000;
-        rawdata = mem32(addr+8);
-        u = (rawdata & 0xFFFF0000)
-                     / 0x00010000;
-        v = (rawdata & 0x0000FFFF)
-                     / 0x00000001;
-        rawdata = mem32(addr+12);
-        i = (rawdata & 0xFF000000)
-                     / 0x01000000;
-        j = (rawdata & 0x00FF0000)
-                     / 0x00010000;
-        k = (rawdata & 0x0000FF00)
-                     / 0x00000100;
-        l = (rawdata & 0x000000FF)
-                     / 0x00000001;
-        if(print)
-            {}//printf("made vertex %d %d %d : %d %d %d\n", x, y, z, i, j, k);
+        float t1 = (node.low[a]-origin[a])*inverse[a];
+        float t2 = (node.high[a]-origin[a])*inverse[a];
+        // a ray parallel to the slab and inside it gives 0*inf; treat as no limit
+        if(t1 != t1) t1 = -INFINITY;
+        if(t2 != t2) t2 = INFINITY;
+        near = fmaxf(near, fminf(t1, t2));
+        far = fminf(far, fmaxf(t1, t2));
     }
-};
+    return near <= far;
+}
 
-struct dlistpointer
+// closest hit along a ray, in zmap vertex coordinates
+bool raycast(std::vector<mesh> & meshes, const float origin[3], const float dir[3], float & distance)
 {
-    char * buffer;
-    uint32_t offset;
-};
+    float inverse[3] = {1/dir[0], 1/dir[1], 1/dir[2]};
+    bool hit = false;
+    distance = INFINITY;
+    for(auto & m : meshes)
+    {
+        if(m.bvh.size() == 0)
+            continue;
+        uint32_t stack[64];
+        int depth = 0;
+        stack[depth++] = 0;
+        while(depth > 0)
+        {
+            auto & node = m.bvh[stack[--depth]];
+            if(!raybox(node, origin, inverse, distance))
+                continue;
+            if(node.count > 0)
+            {
+                for(auto n = node.start; n < node.start+node.count; n++)
+                {
+                    float t;
+                    if(raytri(m, m.bvhtris[n], origin, dir, t) and t < distance)
+                    {
+                        distance = t;
+                        hit = true;
+                    }
+                }
+                continue;
+            }
+            stack[depth++] = node.start;
+            stack[depth++] = &node - &m.bvh[0] + 1;
+        }
+    }
+    return hit;
+}
 
-int main(int argc, char ** argv)
+int runserver(const char * path)
 {
-    if(argc<2)
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(address.sun_path))
+    {   puts("Socket path too long."); return 0; }
+    strcpy(address.sun_path, path);
+    
+    if(SDL_Init(SDL_INIT_VIDEO))
     {
-        puts("Usage: zev2 mymap.zmap <others>");
+        printf("SDL_Init failed: %s",SDL_GetError());
         return 0;
     }
+    // frames go to a framebuffer object, the window only carries the context
+    SDL_Window* window = SDL_CreateWindow("ZEV", 0, 0, 64, 64, SDL_WINDOW_OPENGL|SDL_WINDOW_HIDDEN);
+    if(!window)
+    {
+        printf("SDL_CreateWindow failed: %s",SDL_GetError());
+        return 0;
+    }
+    SDL_GL_CreateContext(window);
+    if(!loadglfuncs() or !loadserverglfuncs())
+        return 0;
     
-    std::vector<char*> files;
+    GLuint program = buildprogram();
+    if(!program)
+        return 0;
+    GLint uniform_lit = glGetUniformLocation(program, "lit");
     
-    for(auto i = 1; i < argc; i++)
-        files.push_back(argv[i]);
+    glClearColor(0.4f, 0.6f, 0.8f, 1.0f);
+    glClearDepth(1.0f);
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LEQUAL);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
     
-    std::vector<dlistpointer> opaque_dlists;
-    std::vector<dlistpointer> glassy_dlists;
+    GLint maxsize;
+    glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &maxsize);
+    GLuint fbo, colorbuffer, depthbuffer;
+    glGenFramebuffers(1, &fbo);
+    glGenRenderbuffers(1, &colorbuffer);
+    glGenRenderbuffers(1, &depthbuffer);
+    int fbwidth = 0;
+    int fbheight = 0;
     
-    unsigned index = 0;
-    for(auto filename : files)
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if(listener < 0
+    or bind(listener, (sockaddr*)&address, sizeof(address)) < 0
+    or listen(listener, 64) < 0)
+    {
+        printf("Could not listen on %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    std::thread acceptor(acceptclients, listener);
+    printf("Listening on %s\n", path);
+    
+    std::map<std::string, std::vector<mesh>> scenes;
+    std::map<int, connection> connections;
+    unsigned shmcount = 0;
+    
+    while(1)
     {
-        index = 0;
-        auto file = fopen(filename, "rb");
-        if (file == NULL)
+        job next;
         {
-            puts("Could not open file.");
-            return 0;
+            std::unique_lock<std::mutex> lock(jobmutex);
+            jobready.wait(lock, []{ return jobs.size() > 0; });
+            next = jobs.front();
+            jobs.pop_front();
         }
-        printf("Loading map %s", filename);
+        int fd = next.client;
         
-        fseek(file, 0, SEEK_END);
-        auto filesize = ftell(file);
-        fseek(file, 0, SEEK_SET);
-        
-        currentzmap = (char*)malloc(filesize);
-        
-        fread(currentzmap, 1, filesize, file);
-        
-        fclose(file);
-        
-        
-        
-        bool breakout = false;
-        
-        unsigned meshaddress = 0;
-        
-        while(breakout == false)
+        if(next.line.size() == 0)
         {
-            switch (mem8(index))
+            closeconnection(connections[fd]);
+            connections.erase(fd);
             {
-            case 0x00:
-                puts("Start positions"); break;
-            case 0x01:
-                puts("Actor list"); break;
-            case 0x02:
-                puts("Cameras"); break;
-            case 0x03:
-                puts("Collision"); break;
-            case 0x04:
-                puts("Maplist"); break;
-            case 0x05:
-                puts("Wind info"); break;
-            case 0x06:
-                puts("Entrance list"); break;
-            case 0x07:
-                puts("Special objects"); break;
-            case 0x08:
-                puts("Room behavior"); break;
-            case 0x09:
-                puts("Unused?"); break;
-            case 0x0A:
-                meshaddress = mem32(index+4);
-                printf("Mesh address %08X\n", meshaddress); break;
-            case 0x0B:
-                puts("Object list"); break;
-            case 0x0C:
-                puts("Unused env settings"); break;
-            case 0x0D:
-                puts("Paths"); break;
-            case 0x0E:
-                puts("Transition actor list"); break;
-            case 0x0F:
-                puts("Env settings"); break;
-            case 0x10:
-                puts("Time settings"); break;
-            case 0x11:
-                puts("Skybox settings"); break;
-            case 0x12:
-                puts("Skybox modifier"); break;
-            case 0x13:
-                puts("Exit List"); break;
-            case 0x14:
-                puts("End of header"); breakout = true; break;
-            case 0x15:
-                puts("Sound settings (scene)"); break;
-            case 0x16:
-                puts("Sound settings (room)"); break;
-            case 0x17:
-                puts("Cutscenes"); break;
-            case 0x18:
-                puts("Extra headers"); break;
-            case 0x19:
-                puts("Camera, world map"); break;
-            default:
-                puts("Unknown");
+                // the reader is on its way out; the fd can't be reused until it's closed
+                std::lock_guard<std::mutex> lock(readermutex);
+                readers[fd].join();
+                readers.erase(fd);
             }
-            index += 8;
+            close(fd);
+            continue;
         }
         
-        if(meshaddress>>24 != 0x03)
-        {   printf("Unsupported mesh header bank. %02X",meshaddress>>24); return 0; }
-        
-        
-        
-        uint8_t count;
-        uint32_t start;
-        uint32_t end;
-        
-        index = meshaddress&0x00FFFFFF;
-        
-        int meshtype = -1;
+        std::vector<std::string> words;
+        for(char * word = strtok(&next.line[0], " \t"); word; word = strtok(NULL, " \t"))
+            words.push_back(word);
+        if(words.size() == 0)
+        {
+            respond(fd, "error bad request");
+            continue;
+        }
+        auto & command = words[0];
         
-        switch (mem8(index))
+        if(command == "shutdown")
         {
-        case 0x00:
-        case 0x02:
-            count = mem8(index+1);
-            start = mem32(index+4);
-            end = mem32(index+8);
-            puts("Found the meshes");
-            meshtype = mem8(index);
+            respond(fd, "ok");
             break;
-        default:
-            puts("Unsupported mesh type in mesh header."); printf("%08X\n",index); return 0;
+        }
+        if(words.size() < 2)
+        {
+            respond(fd, "error expected a scene name");
+            continue;
         }
         
-        if(start>>24 != 0x03)
-        {   printf("Unsupported mesh data bank. %02X",start>>24); return 0; }
-        printf("%d\n", count);
+        if(command == "load" and words.size() >= 3)
+        {
+            std::vector<mesh> meshes;
+            bool loaded = true;
+            for(unsigned n = 2; n < words.size() and loaded; n++)
+            {
+                meshes.emplace_back();
+                loaded = loadzmap(words[n].c_str(), meshes.back());
+            }
+            if(!loaded)
+            {
+                respond(fd, "error could not load %s", words[1].c_str());
+                continue;
+            }
+            if(scenes.count(words[1]))
+                for(auto & m : scenes[words[1]])
+                    freemesh(m);
+            unsigned tris = 0;
+            unsigned verts = 0;
+            for(auto & m : meshes)
+            {
+                uploadmesh(m);
+                buildbvh(m);
+                tris += m.indices.size()/3;
+                verts += m.verts.size();
+            }
+            scenes[words[1]] = std::move(meshes);
+            respond(fd, "ok %u %u", tris, verts);
+            continue;
+        }
         
-        index = start&0x00FFFFFF;
+        if(!scenes.count(words[1]))
+        {
+            respond(fd, "error no scene %s", words[1].c_str());
+            continue;
+        }
+        auto & meshes = scenes[words[1]];
         
-        if(meshtype == 0)
+        if(command == "unload")
         {
-            for(auto i = 0; i < count; i++)
+            for(auto & m : meshes)
+                freemesh(m);
+            scenes.erase(words[1]);
+            respond(fd, "ok");
+        }
+        else if(command == "stats")
+        {
+            unsigned tris = 0, verts = 0, batches = 0;
+            for(auto & m : meshes)
             {
-                if(mem8(index) == 0x03)
-                    opaque_dlists.push_back({currentzmap, mem32(index)&0x00FFFFFF});
-                if(mem8(index+4) == 0x03)
-                    glassy_dlists.push_back({currentzmap, mem32(index+4)&0x00FFFFFF});
-                index += 8;
+                tris += m.indices.size()/3;
+                verts += m.verts.size();
+                batches += m.batches.size();
             }
-            puts("Installed dlists");
+            sharestats stats = getsharestats(meshes);
+            respond(fd, "ok %u %u %u %u %u %u %u", tris, verts, batches
+                , stats.shared, stats.collapsed, stats.sharedtris, stats.skippedtris);
         }
-        if(meshtype == 2)
+        else if(command == "raycast" and words.size() == 8)
         {
-            for(auto i = 0; i <= count; i++)
+            // viewer axes to vertex axes: y and z swap
+            float origin[3] = {float(atof(words[2].c_str())), float(atof(words[4].c_str())), float(atof(words[3].c_str()))};
+            float dir[3] = {float(atof(words[5].c_str())), float(atof(words[7].c_str())), float(atof(words[6].c_str()))};
+            float length = sqrtf(dir[0]*dir[0] + dir[1]*dir[1] + dir[2]*dir[2]);
+            if(length == 0)
             {
-                if(mem8(index+8) == 0x03)
-                    opaque_dlists.push_back({currentzmap, mem32(index+8)&0x00FFFFFF});
-                if(mem8(index+12) == 0x03)
-                    glassy_dlists.push_back({currentzmap, mem32(index+12)&0x00FFFFFF});
-                index += 16;
+                respond(fd, "error zero length ray");
+                continue;
             }
-            puts("Installed dlists");
+            for(int a = 0; a < 3; a++)
+                dir[a] /= length;
+            float distance;
+            if(raycast(meshes, origin, dir, distance))
+                respond(fd, "ok hit %f %f %f %f", distance
+                    , origin[0]+dir[0]*distance
+                    , origin[2]+dir[2]*distance
+                    , origin[1]+dir[1]*distance);
+            else
+                respond(fd, "ok miss");
         }
-        
+        else if(command == "render" and words.size() == 9)
+        {
+            int width = atoi(words[2].c_str());
+            int height = atoi(words[3].c_str());
+            if(width < 1 or height < 1 or width > maxsize or height > maxsize)
+            {
+                respond(fd, "error bad frame size");
+                continue;
+            }
+            
+            auto & c = connections[fd];
+            size_t bytes = size_t(width)*height*4;
+            if(bytes > c.framesize)
+            {
+                if(c.shmfd < 0)
+                {
+                    c.shmname = "/zev-" + std::to_string(getpid()) + "-" + std::to_string(shmcount++);
+                    c.shmfd = shm_open(c.shmname.c_str(), O_RDWR|O_CREAT|O_EXCL, 0600);
+                }
+                if(c.frame)
+                    munmap(c.frame, c.framesize);
+                c.frame = NULL;
+                c.framesize = 0;
+                if(c.shmfd < 0 or ftruncate(c.shmfd, bytes) < 0)
+                {
+                    respond(fd, "error could not allocate shared memory");
+                    continue;
+                }
+                c.frame = mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_SHARED, c.shmfd, 0);
+                if(c.frame == MAP_FAILED)
+                {
+                    c.frame = NULL;
+                    respond(fd, "error could not map shared memory");
+                    continue;
+                }
+                c.framesize = bytes;
+            }
+            
+            glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+            if(width != fbwidth or height != fbheight)
+            {
+                glBindRenderbuffer(GL_RENDERBUFFER, colorbuffer);
+                glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+                glBindRenderbuffer(GL_RENDERBUFFER, depthbuffer);
+                glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+                glBindRenderbuffer(GL_RENDERBUFFER, 0);
+                glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorbuffer);
+                glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthbuffer);
+                fbwidth = width;
+                fbheight = height;
+            }
+            if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            {
+                glBindFramebuffer(GL_FRAMEBUFFER, 0);
+                respond(fd, "error framebuffer incomplete");
+                continue;
+            }
+            
+            glViewport(0, 0, width, height);
+            glMatrixMode(GL_PROJECTION);
+            glLoadIdentity();
+            gluPerspective(80.0f, float(width)/height, 1.0f, 65536.0f*2);
+            glMatrixMode(GL_MODELVIEW);
+            glLoadIdentity();
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            
+            // same camera as the viewer
+            glRotatef(atof(words[8].c_str()), 1.0, 0, 0);
+            glRotatef(atof(words[7].c_str()), 0, 1.0, 0);
+            glTranslatef(-atof(words[4].c_str()), -atof(words[6].c_str()), -atof(words[5].c_str()));
+            
+            glUseProgram(program);
+            for(auto & m : meshes)
+                drawmesh(m, uniform_lit);
+            glUseProgram(0);
+            
+            glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, c.frame);
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            respond(fd, "ok %s %d %d %u", c.shmname.c_str(), width, height, (unsigned)bytes);
+        }
+        else
+            respond(fd, "error bad request");
+    }
+    
+    // wake the acceptor and every reader out of their blocking calls, and
+    // wait for them before the queue they push to goes away
+    stopping = true;
+    shutdown(listener, SHUT_RDWR);
+    acceptor.join();
+    close(listener);
+    unlink(path);
+    for(auto & pair : readers)
+        shutdown(pair.first, SHUT_RDWR);
+    for(auto & pair : readers)
+    {
+        pair.second.join();
+        close(pair.first);
+    }
+    for(auto & pair : connections)
+        closeconnection(pair.second);
+    SDL_Quit();
+    return 0;
+}
+
+#endif
+
+int main(int argc, char ** argv)
+{
+    if(argc<2)
+    {
+        puts("Usage: zev2 mymap.zmap <others>");
+        puts("       zev2 --server /path/to/socket");
+        return 0;
+    }
+    
+    #ifndef _WIN32
+    if(strcmp(argv[1], "--server") == 0)
+    {
+        if(argc<3)
+        {
+            puts("Usage: zev2 --server /path/to/socket");
+            return 0;
+        }
+        return runserver(argv[2]);
+    }
+    #endif
+    
+    std::vector<char*> files;
+    
+    for(auto i = 1; i < argc; i++)
+        files.push_back(argv[i]);
+    
+    std::vector<mesh> meshes;
+    unsigned dlists = 0;
+    
+    for(auto filename : files)
+    {
+        meshes.emplace_back();
+        if(!loadzmap(filename, meshes.back()))
+            return 0;
+        dlists += meshes.back().dlists;
+    }
+    if(meshes.size() > 1)
+    {
+        sharestats stats = getsharestats(meshes);
+        printf("Scene total: shared %d sub-dlists: %d calls collapsed, %d triangles shared, %d triangles not redrawn\n"
+            , stats.shared, stats.collapsed, stats.sharedtris, stats.skippedtris);
     }
     
     if(SDL_Init(SDL_INIT_VIDEO))
@@ -306,6 +2256,20 @@ int main(int argc, char ** argv)
     
     SDL_GL_CreateContext(window);
     
+    if(!loadglfuncs())
+        return 0;
+    
+    GLuint program = buildprogram();
+    if(!program)
+        return 0;
+    GLint uniform_lit = glGetUniformLocation(program, "lit");
+    
+    for(auto & m : meshes)
+    {
+        uploadmesh(m);
+        uploadnormals(m);
+    }
+    
     glViewport(0, 0, 800, 600);
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
@@ -322,13 +2286,6 @@ int main(int argc, char ** argv)
     glHint(GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST);
     
     
-    glEnable(GL_NORMALIZE);
-    glEnable(GL_LIGHTING);
-    glEnable(GL_LIGHT0);
-    GLfloat asdasgasfbasd[] = {0.0f, 0.0f, 0.0f, 1.0f};
-    glLightfv(GL_LIGHT0, GL_DIFFUSE, asdasgasfbasd);
-    glEnable(GL_LIGHT1);
-    
     float xpos = 0;
     float ypos = 100;
     float zpos = 0;
@@ -342,11 +2299,10 @@ int main(int argc, char ** argv)
     int ydelta = 0;
     
     SDL_Event event;
-    bool firstrun = true;
     
     uint32_t oldtime = SDL_GetTicks();
     uint32_t newtime = SDL_GetTicks()+100;
-    while(opaque_dlists.size() > 0)
+    while(dlists > 0)
     {
         while(SDL_PollEvent( &event ))
             if(event.type == SDL_QUIT) goto quit;
@@ -402,9 +2358,6 @@ int main(int argc, char ** argv)
         
         // draw crosshair
         
-        glDisable(GL_LIGHTING);
-        
-        
         glPolygonOffset(-10000,-1);
         glBegin(GL_QUADS);
         
@@ -421,7 +2374,6 @@ int main(int argc, char ** argv)
         glVertex3f(-1.0/50, 0.1/50, -1);
         
         glEnd();
-        glEnable(GL_LIGHTING);
         
         // handle modal state
         glRotatef(pitch, 1.0, 0, 0);
@@ -429,18 +2381,7 @@ int main(int argc, char ** argv)
         
         glTranslatef(-xpos, -zpos, -ypos);
         
-        // fun stuff
-        GLfloat ambientColor[] = {1.4f, 1.5f, 1.6f, 4.0f};
-        glLightModelfv(GL_LIGHT_MODEL_AMBIENT, ambientColor);
-        
-        GLfloat color[] = {1.0f, 0.9f, 0.8f, 1.0f};
-        glLightfv(GL_LIGHT1, GL_DIFFUSE, color);
-        GLfloat pos[] = {1.0f, 1.0f, 0.2f, 0.0f};
-        glLightfv(GL_LIGHT1, GL_POSITION, pos);
-        
         //origin
-        glDisable(GL_LIGHTING);
-        
         glPolygonOffset(-1,-1);
         glBegin(GL_QUADS);
         glColor3f(1,0,0);
@@ -480,261 +2421,31 @@ int main(int argc, char ** argv)
         glVertex3f( 0, 1, 9);
         glEnd();
         
-        glEnable(GL_LIGHTING);
-        
         glPolygonOffset(0,0);
         
+        glUseProgram(program);
+        for(auto & m : meshes)
+            drawmesh(m, uniform_lit);
+        glUseProgram(0);
         
-        for(auto list : opaque_dlists)
+        // normals
+        glLineWidth(1.2);
+        glColor3f(1.0, 0.0, 0.0);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        for(auto & m : meshes)
         {
-            //info
-            //printf("dlist: %08X\n", list);
-            
-            currentzmap = list.buffer;
-            
-            //state
-            std::vector<vertex> verts;
-            std::stack<uint32_t> stack;
-            
-            bool normal = true;
-            bool filter = true;
-            bool normalize = true;
-            bool unsupported = false;
-            index = list.offset;
-            // interpret dlist
-            while(1)
-            {
-                skippc:
-                switch(mem8(index))
-                {
-                case 0x01:
-                    //puts("verts");
-                    {
-                        unsigned int count = (mem32(index)&0xFFF000)/0x1000;
-                        int where = (mem32(index)&0x000FFF)/2;
-                        where -= count;
-                        
-                        int addr = (mem32(index+4)&0x00FFFFFF);
-                        unsigned int max = where+count;
-                        if(mem8(index+4) != 03)
-                        {
-                            unsupported = true;
-                            break;
-                        }
-                        unsupported = false;
-                        if(firstrun)
-                            {}/*printf("vertex command %03X->%03X %03X->%03X %06X\n"
-                                , (mem32(index)&0xFFF000)/0x1000, count
-                                , mem32(index)&0x000FFF, where
-                                , addr);*/
-                        for(unsigned i = 0; i < count; i++)
-                        {
-                            if(where+i >= verts.size())
-                                verts.push_back(vertex(addr + i*16, firstrun));
-                            else
-                                verts[where+i] = vertex(addr + i*16, firstrun);
-                        }
-                    }
-                    break;
-                
-                
-                #define autovertex(index) \
-                    verts[(index)].x, verts[(index)].y, verts[(index)].z
-                #define autoijk(index) \
-                    verts[(index)].i, verts[(index)].j, verts[(index)].k
-                #define autovvv(index) \
-                      verts[(index)].x+verts[(index)].i*0.1\
-                    , verts[(index)].y+verts[(index)].j*0.1\
-                    , verts[(index)].z+verts[(index)].k*0.1
-                #define autorgb(index) \
-                    (uint8_t)(verts[(index)].i), (uint8_t)(verts[(index)].j), (uint8_t)(verts[(index)].k)
-                    
-                    
-                case 0x05:
-                    //puts("tri1");
-                    if(unsupported)
-                        break;
-                    else
-                    {
-                        glBegin(GL_TRIANGLES);
-                        glNormal3f(0.0, 0.0, 1.0);
-                        uint8_t vert1 = mem8(index+1)/2;
-                        uint8_t vert2 = mem8(index+2)/2;
-                        uint8_t vert3 = mem8(index+3)/2;
-                        
-                        if(normalize)
-                        {
-                            glColor3f(1.0f, 1.0f, 1.0f);
-                            
-                            glNormal3f(autoijk(vert1));
-                            glVertex3f(autovertex(vert1));
-                            glNormal3f(autoijk(vert2));
-                            glVertex3f(autovertex(vert2));
-                            glNormal3f(autoijk(vert3));
-                            glVertex3f(autovertex(vert3));
-                        }
-                        else
-                        {
-                            glColor4ub(autorgb(vert1), 255);
-                            glVertex3f(autovertex(vert1));
-                            glColor4ub(autorgb(vert2), 255);
-                            glVertex3f(autovertex(vert2));
-                            glColor4ub(autorgb(vert3), 255);
-                            glVertex3f(autovertex(vert3));
-                        }
-                        glEnd();
-                        
-                        if(normalize)
-                        {
-                            glDisable(GL_LIGHTING);
-                            glLineWidth(1.2);
-                            glColor3f(1.0, 0.0, 0.0);
-                            
-                            glBegin(GL_LINES);
-                            glVertex3f(autovertex(vert1));
-                            glVertex3f(autovvv(vert1));
-                            glVertex3f(autovertex(vert2));
-                            glVertex3f(autovvv(vert2));
-                            glVertex3f(autovertex(vert3));
-                            glVertex3f(autovvv(vert3));
-                            glEnd();
-                            glEnable(GL_LIGHTING);
-                        }
-                    }
-                    break;
-                    
-                    
-                case 0x06:
-                    //puts("tri2");
-                    if(unsupported)
-                        break;
-                    else
-                    {
-                        glBegin(GL_TRIANGLES);
-                        uint8_t vert1 = mem8(index+1)/2;
-                        uint8_t vert2 = mem8(index+2)/2;
-                        uint8_t vert3 = mem8(index+3)/2;
-                        uint8_t vert4 = mem8(index+4+1)/2;
-                        uint8_t vert5 = mem8(index+4+2)/2;
-                        uint8_t vert6 = mem8(index+4+3)/2;
-                        
-                        if(normalize)
-                        {
-                            glColor3f(1.0f, 1.0f, 1.0f);
-                            glNormal3f(autoijk(vert1));
-                            glVertex3f(autovertex(vert1));
-                            glNormal3f(autoijk(vert2));
-                            glVertex3f(autovertex(vert2));
-                            glNormal3f(autoijk(vert3));
-                            glVertex3f(autovertex(vert3));
-                            glNormal3f(autoijk(vert4));
-                            glVertex3f(autovertex(vert4));
-                            glNormal3f(autoijk(vert5));
-                            glVertex3f(autovertex(vert5));
-                            glNormal3f(autoijk(vert6));
-                            glVertex3f(autovertex(vert6));
-                        }
-                        else
-                        {
-                            glColor4ub(autorgb(vert1), 255);
-                            glVertex3f(autovertex(vert1));
-                            glColor4ub(autorgb(vert2), 255);
-                            glVertex3f(autovertex(vert2));
-                            glColor4ub(autorgb(vert3), 255);
-                            glVertex3f(autovertex(vert3));
-                            glColor4ub(autorgb(vert4), 255);
-                            glVertex3f(autovertex(vert4));
-                            glColor4ub(autorgb(vert5), 255);
-                            glVertex3f(autovertex(vert5));
-                            glColor4ub(autorgb(vert6), 255);
-                            glVertex3f(autovertex(vert6));
-                        }
-                        glEnd();
-                        if(normalize)
-                        {
-                            glDisable(GL_LIGHTING);
-                            glLineWidth(1.2);
-                            glColor3f(1.0, 0.0, 0.0);
-                            
-                            glBegin(GL_LINES);
-                            glVertex3f(autovertex(vert1));
-                            glVertex3f(autovvv(vert1));
-                            glVertex3f(autovertex(vert2));
-                            glVertex3f(autovvv(vert2));
-                            glVertex3f(autovertex(vert3));
-                            glVertex3f(autovvv(vert3));
-                            glVertex3f(autovertex(vert4));
-                            glVertex3f(autovvv(vert4));
-                            glVertex3f(autovertex(vert5));
-                            glVertex3f(autovvv(vert5));
-                            glVertex3f(autovertex(vert6));
-                            glVertex3f(autovvv(vert6));
-                            glEnd();
-                            glEnable(GL_LIGHTING);
-                        }
-                    }
-                    break;
-                case 0x07:
-                    //puts("quad");
-                    // TODO
-                    break;
-                case 0xD9:
-                    //puts("mode");
-                    {
-                        bool filterclear = ((0x00200000&mem32(index  )) != 0);
-                        bool normalclear = ((0x00020000&mem32(index  )) != 0);
-                        bool filterenset = ((0x00200000&mem32(index+4)) != 0);
-                        bool normalenset = ((0x00020000&mem32(index+4)) != 0);
-                        
-                        filter = filterenset|(filter&filterclear);
-                        normal = normalenset|(normal&normalclear);
-                        
-                        if(normal)
-                        {
-                            normalize = true;
-                            glEnable(GL_LIGHTING);
-                        }
-                        else if(filter)
-                        {
-                            normalize = false;
-                            glDisable(GL_LIGHTING);
-                        }
-                    }
-                    // TODO
-                    break;
-                case 0xDE:
-                    //puts("subdl");
-                    if(mem8(index+4) != 0x03)
-                        break;
-                    stack.push(index+8);
-                    index=mem32(index+4)&0x00FFFFFF;
-                    goto skippc;
-                    break;
-                case 0xDF:
-                    //puts("return");
-                    if(stack.size() > 0)
-                    {
-                        index = stack.top();
-                        stack.pop();
-                        goto skippc;
-                    }
-                    else
-                        goto finished;
-                    break;
-                }
-                index += 8;
-            }
-            finished:
-            //printf("%08X: %08X\n",index,mem32(index));
-            ;
+            glBindBuffer(GL_ARRAY_BUFFER, m.normalvbo);
+            glVertexPointer(3, GL_FLOAT, 0, NULL);
+            glDrawArrays(GL_LINES, 0, m.normalcount);
         }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glDisableClientState(GL_VERTEX_ARRAY);
         
         glFlush();
         
         SDL_GL_SwapWindow(window); 
         
         SDL_Delay(5);
-        firstrun = false;
     }
     
     quit:
@@ -0,0 +1,255 @@
+/*    Copyright (c) 2015, Professional Zelda Hackers Std.
+
+Permission to use, copy, modify, and/or distribute this software for any purpose
+ with or without fee is hereby granted, provided that the above copyright notice
+  and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF
+THIS SOFTWARE.
+*/
+
+// Writes synthetic room zmaps in exactly the subset zev understands, for
+// seeing how it scales past what real maps contain. Every room is one file:
+//   0x00 header: 0x0A (mesh header address), 0x14 (end)
+//   0x10 mesh header, type 0 or 2, one entry
+//   0x40 vertex data
+//   ...  dlists, one per nesting level, each calling the next through 0xDE
+// Triangles come in strips of up to 30, each one vertex load (0x01) of up to
+// 32 vertices, a mode change (0xD9) picking lit or unlit, and 0x06/0x05s.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#include <vector>
+
+#define STRIPTRIS 30
+#define MAXDEPTH 64 // zev's MAXDLISTDEPTH; deeper files fail to load
+
+// xorshift64*, so the same seed gives the same maps on every platform
+uint64_t rngstate;
+
+uint32_t rng()
+{
+    rngstate ^= rngstate >> 12;
+    rngstate ^= rngstate << 25;
+    rngstate ^= rngstate >> 27;
+    return (rngstate * 0x2545F4914F6CDD1DULL) >> 32;
+}
+int rngrange(int low, int high)
+{
+    return low + rng()%(high-low+1);
+}
+
+std::vector<uint8_t> file;
+
+void put8(uint32_t addr, uint8_t value)
+{
+    file[addr] = value;
+}
+void put16(uint32_t addr, uint16_t value)
+{
+    file[addr  ] = value>>8;
+    file[addr+1] = value;
+}
+void put32(uint32_t addr, uint32_t value)
+{
+    put16(addr  , value>>16);
+    put16(addr+2, value);
+}
+void putcommand(uint32_t & addr, uint32_t word0, uint32_t word1)
+{
+    put32(addr  , word0);
+    put32(addr+4, word1);
+    addr += 8;
+}
+
+struct strip
+{
+    unsigned tris;
+    unsigned level; // which dlist it goes in
+    uint32_t verts; // address of its vertex data
+};
+
+int main(int argc, char ** argv)
+{
+    if(argc<4)
+    {
+        puts("Usage: zmapgen prefix rooms trisperroom [depth] [litpercent] [seed] [meshtype]");
+        puts("Writes prefix_0.zmap, prefix_1.zmap, ... for passing to zev");
+        return 0;
+    }
+    
+    const char * prefix = argv[1];
+    int rooms = atoi(argv[2]);
+    long trisperroom = atol(argv[3]);
+    int depth = (argc>4) ? atoi(argv[4]) : 0;
+    int litpercent = (argc>5) ? atoi(argv[5]) : 50;
+    uint64_t seed = (argc>6) ? strtoull(argv[6], NULL, 0) : 1;
+    int meshtype = (argc>7) ? atoi(argv[7]) : 0;
+    
+    if(rooms < 1 or trisperroom < 1 or depth < 0 or litpercent < 0 or litpercent > 100)
+    {   puts("Bad parameters."); return 0; }
+    if(depth > MAXDEPTH)
+    {   printf("Depth can be at most %d, zev refuses dlists nested deeper.\n", MAXDEPTH); return 0; }
+    if(meshtype != 0 and meshtype != 2)
+    {   puts("Mesh type must be 0 or 2."); return 0; }
+    
+    // rooms sit on a square grid filling the int16 range
+    int across = ceil(sqrt(rooms));
+    int cellsize = 65000/across;
+    
+    long total = 0;
+    for(auto room = 0; room < rooms; room++)
+    {
+        rngstate = (seed+1) * 0x9E3779B97F4A7C15ULL + room;
+        rng();
+        
+        std::vector<strip> strips;
+        for(long left = trisperroom; left > 0; left -= STRIPTRIS)
+            strips.push_back({unsigned(left < STRIPTRIS ? left : STRIPTRIS), 0, 0});
+        
+        // spread the strips over the nesting levels and lay out the file
+        std::vector<uint32_t> levelsize(depth+1, 8); // every level ends in 0xDF
+        for(unsigned n = 0; n < strips.size(); n++)
+        {
+            strips[n].level = n%(depth+1);
+            levelsize[strips[n].level] += 8 + 8 + (strips[n].tris+1)/2*8;
+        }
+        for(auto level = 0; level < depth; level++)
+            levelsize[level] += 8; // 0xDE
+        
+        uint32_t addr = 0x40;
+        for(auto & s : strips)
+        {
+            s.verts = addr;
+            addr += ((s.tris+1)/2+1)*2*16;
+        }
+        std::vector<uint32_t> leveladdr(depth+1);
+        for(auto level = 0; level <= depth; level++)
+        {
+            leveladdr[level] = addr;
+            addr += levelsize[level];
+        }
+        if(addr > 0x01000000)
+        {
+            printf("Room %d doesn't fit in a 16MB segment; use fewer triangles per room.\n", room);
+            return 0;
+        }
+        file.assign(addr, 0);
+        
+        // header and mesh header
+        put32(0x00, 0x0A000000);
+        put32(0x04, 0x03000010);
+        put32(0x08, 0x14000000);
+        put8(0x10, meshtype);
+        put8(0x11, 1);
+        put32(0x14, 0x03000020);
+        if(meshtype == 0)
+        {
+            put32(0x18, 0x03000028);
+            put32(0x20, 0x03000000|leveladdr[0]);
+        }
+        else
+        {
+            put32(0x18, 0x03000030);
+            put32(0x28, 0x03000000|leveladdr[0]);
+            // zev reads one entry past the count for type 2, leave it empty
+        }
+        
+        int originx = (room%across)*cellsize - 32500;
+        int originz = (room/across)*cellsize - 32500;
+        
+        std::vector<uint32_t> cursor(leveladdr);
+        for(auto & s : strips)
+        {
+            uint32_t & pc = cursor[s.level];
+            bool lit = rngrange(0, 99) < litpercent;
+            unsigned quads = (s.tris+1)/2;
+            unsigned verts = (quads+1)*2;
+            
+            // a bumpy ribbon at a random spot and heading inside the room
+            int x = originx + rngrange(0, cellsize-1);
+            int y = rngrange(-500, 500);
+            int z = originz + rngrange(0, cellsize-1);
+            float heading = rngrange(0, 359) * 3.141592653589793 / 180.0;
+            int step = rngrange(20, 200);
+            int width = rngrange(20, 200);
+            for(unsigned n = 0; n < verts; n++)
+            {
+                float along = (n/2)*step;
+                float side = (n%2)*width;
+                int vx = x + along*cos(heading) - side*sin(heading);
+                int vz = z + along*sin(heading) + side*cos(heading);
+                int vy = y + rngrange(-20, 20);
+                if(vx < -32768) vx = -32768;
+                if(vx > 32767) vx = 32767;
+                if(vz < -32768) vz = -32768;
+                if(vz > 32767) vz = 32767;
+                
+                uint32_t v = s.verts + n*16;
+                put16(v+0, vx);
+                put16(v+2, vy);
+                put16(v+4, vz);
+                put16(v+8, (n/2)*32*32);
+                put16(v+10, (n%2)*32*32);
+                if(lit)
+                {   // roughly up
+                    put8(v+12, rngrange(-20, 20));
+                    put8(v+13, 120);
+                    put8(v+14, rngrange(-20, 20));
+                }
+                else
+                {
+                    put8(v+12, rngrange(0, 255));
+                    put8(v+13, rngrange(0, 255));
+                    put8(v+14, rngrange(0, 255));
+                }
+                put8(v+15, 0xFF);
+            }
+            
+            // 0xD9: keep everything but lighting, then set smooth shading,
+            // back face culling and, for lit strips, lighting
+            putcommand(pc, 0xD9FDFFFF, lit ? 0x00220400 : 0x00200400);
+            putcommand(pc, 0x01000000 | verts<<12 | verts*2, 0x03000000|s.verts);
+            for(unsigned q = 0; q < quads; q++)
+            {
+                unsigned a = q*2;
+                // vertex buffer indices are doubled in the commands
+                if(q*2+1 < s.tris)
+                    putcommand(pc, 0x06000000 | a*2<<16 | (a+1)*2<<8 | (a+3)*2
+                                 , (a+0)*2<<16 | (a+3)*2<<8 | (a+2)*2);
+                else
+                    putcommand(pc, 0x05000000 | a*2<<16 | (a+1)*2<<8 | (a+3)*2, 0);
+            }
+        }
+        for(auto level = 0; level <= depth; level++)
+        {
+            if(level < depth)
+                putcommand(cursor[level], 0xDE000000, 0x03000000|leveladdr[level+1]);
+            putcommand(cursor[level], 0xDF000000, 0);
+        }
+        
+        char filename[4096];
+        snprintf(filename, sizeof(filename), "%s_%d.zmap", prefix, room);
+        auto out = fopen(filename, "wb");
+        if (out == NULL)
+        {
+            printf("Could not open %s for writing.\n", filename);
+            return 0;
+        }
+        fwrite(file.data(), 1, file.size(), out);
+        fclose(out);
+        
+        total += trisperroom;
+    }
+    printf("Wrote %d rooms, %ld triangles\n", rooms, total);
+    
+    return 0;
+}